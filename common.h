@@ -3,6 +3,7 @@
 #include <ctype.h>
 #include <time.h>
 #include <signal.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,32 +13,672 @@
 #define CBUG(c) if (c) { fprintf(stderr, "CBUG! " #c " %s:%s:%d\n", \
 		__FILE__, __FUNCTION__, __LINE__); raise(SIGINT); }
 
+#define USERNAME_MAX_LEN 32
+
 DB_TXN *txnid;
 
-/* read a word */
+/* like isspace in the "C" locale, without looking at the locale */
+static inline int
+is_space(unsigned char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* read a word without copying it. The input doesn't have to be NUL
+ * terminated, we stop at end. Returns where the word starts, and puts its
+ * length in *len */
+static inline char *
+read_tok(char **input, char *end, size_t *len)
+{
+	char *inp = *input, *ret;
+
+	for (; inp < end && is_space(*inp); inp++);
+
+	for (ret = inp; inp < end && !is_space(*inp); inp++);
+
+	*len = inp - ret;
+	*input = inp;
+	return ret;
+}
+
+/* what can be wrong with a line (see ev_parse) */
+enum parse_err {
+	PE_OK,
+	PE_DATE_FORMAT,
+	PE_DATE_RANGE,
+	PE_AMOUNT_FORMAT,
+	PE_AMOUNT_RANGE,
+	PE_MAX,
+};
+
+static char *parse_errs[] = {
+	"",
+	"date is not YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS",
+	"date does not exist",
+	"amount is not like 12, 12.3 or 12.34 (or 12,34)",
+	"amount is too big",
+};
+
+/* are all bytes of w that are in mask digits? Bytes not in mask are made
+ * '0' first, so that they don't get in the way. Then a byte is a digit if it
+ * is 0x3?, and still 0x3? after adding 6 (so it is not 0x3a to 0x3f). */
+static inline int
+swar_digits(uint64_t w, uint64_t mask)
+{
+	const uint64_t zeros = 0x3030303030303030ULL,
+	      high = 0xf0f0f0f0f0f0f0f0ULL;
+
+	w = (w & mask) | (zeros & ~mask);
+	return (w & high) == zeros
+		&& ((w + 0x0606060606060606ULL) & high) == zeros;
+}
+
+static inline unsigned
+dig2(const char *p)
+{
+	return (p[0] - '0') * 10 + p[1] - '0';
+}
+
+/* Days since 1970-01-01 of a date in the (proleptic) Gregorian calendar.
+ * Years are counted from March, so that the leap day is at the end of the
+ * year, and split into eras of 400 years (which all have the same number of
+ * days). This is Howard Hinnant's days_from_civil. */
+static inline int64_t
+days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+	int64_t era;
+	unsigned yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400; // year of the era [0, 399]
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1; // [0, 365]
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy; // [0, 146096]
+	return era * 146097 + (int64_t) doe - 719468;
+}
+
+static inline unsigned
+month_days(unsigned y, unsigned m)
+{
+	static const unsigned char days[] = {
+		31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31,
+	};
+
+	if (m == 2 && y % 4 == 0 && (y % 100 != 0 || y % 400 == 0))
+		return 29;
+
+	return days[m - 1];
+}
+
+/* Convert a date in one of the forms the README allows ("YYYY-MM-DD" or
+ * "YYYY-MM-DDTHH:MM:SS", maybe followed by "Z") to a unix timestamp (UTC).
+ * Since the layout is fixed, we check that the digits are digits eight at a
+ * time (see swar_digits), and the separators one by one. A date only is the
+ * midnight it starts with, and "T24:00:00" is the midnight it ends with.
+ * Returns PE_OK, or what is wrong with it. */
+static inline int
+ts_parse(const char *s, size_t len, time_t *ts)
+{
+	/* which bytes are digits in "YYYY-MM-" and in "DDTHH:MM" */
+	static const unsigned char date_digits[8] = {
+		0xff, 0xff, 0xff, 0xff, 0, 0xff, 0xff, 0,
+	}, time_digits[8] = {
+		0xff, 0xff, 0, 0xff, 0xff, 0, 0xff, 0xff,
+	};
+	unsigned y, m, d, h = 0, mi = 0, sec = 0;
+	uint64_t w, mask;
+
+	if (len != 10 && len != 19 && (len != 20 || s[19] != 'Z'))
+		return PE_DATE_FORMAT;
+
+	memcpy(&w, s, sizeof(w));
+	memcpy(&mask, date_digits, sizeof(mask));
+	if (!swar_digits(w, mask) || s[4] != '-' || s[7] != '-')
+		return PE_DATE_FORMAT;
+
+	if (len == 10) {
+		if (!isdigit((unsigned char) s[8])
+				|| !isdigit((unsigned char) s[9]))
+			return PE_DATE_FORMAT;
+	} else {
+		memcpy(&w, s + 8, sizeof(w));
+		memcpy(&mask, time_digits, sizeof(mask));
+		if (!swar_digits(w, mask) || s[10] != 'T' || s[13] != ':'
+				|| s[16] != ':'
+				|| !isdigit((unsigned char) s[17])
+				|| !isdigit((unsigned char) s[18]))
+			return PE_DATE_FORMAT;
+		h = dig2(s + 11);
+		mi = dig2(s + 14);
+		sec = dig2(s + 17);
+	}
+
+	y = dig2(s) * 100 + dig2(s + 2);
+	m = dig2(s + 5);
+	d = dig2(s + 8);
+
+	if (m < 1 || m > 12 || d < 1 || d > month_days(y, m) || mi > 59
+			|| sec > 59 || h > 24 || (h == 24 && (mi || sec)))
+		return PE_DATE_RANGE;
+
+	*ts = days_from_civil(y, m, d) * 86400 + h * 3600 + mi * 60 + sec;
+	return PE_OK;
+}
+
+/* Read an amount of money ("12", "12.3", "-12,34"...) as a number of cents.
+ * There are no floating point numbers involved, so it is exact, and it
+ * doesn't depend on the locale. Returns PE_OK, or what is wrong with it. */
+static inline int
+read_currency(char **line, char *end, int64_t *value)
+{
+	size_t len;
+	char *s = read_tok(line, end, &len), *e = s + len;
+	int64_t v = 0;
+	int neg = 0;
+
+	if (s < e && *s == '-') {
+		neg = 1;
+		s++;
+	}
+
+	if (s == e || !isdigit((unsigned char) *s))
+		return PE_AMOUNT_FORMAT;
+
+	for (; s < e && isdigit((unsigned char) *s); s++) {
+		if (v > (INT64_MAX / 100 - 99) / 10)
+			return PE_AMOUNT_RANGE;
+		v = v * 10 + *s - '0';
+	}
+
+	v *= 100;
+
+	/* cents */
+	if (s < e && (*s == '.' || *s == ',')) {
+		if (++s == e || !isdigit((unsigned char) *s))
+			return PE_AMOUNT_FORMAT;
+		v += (*s++ - '0') * 10;
+		if (s < e && isdigit((unsigned char) *s))
+			v += *s++ - '0';
+	}
+
+	if (s != e)
+		return PE_AMOUNT_FORMAT;
+
+	*value = neg ? -v : v;
+	return PE_OK;
+}
+
+/* read a date (see ts_parse). Returns PE_OK, or what is wrong with it */
+static inline int
+read_ts(char **line, char *end, time_t *ts)
+{
+	size_t len;
+	char *tok = read_tok(line, end, &len);
+	return ts_parse(tok, len, ts);
+}
+
+/* hash a sequence of bytes, eight at a time. Not cryptographic, just good
+ * enough to notice that a file was edited. Pass 0 as the initial h. */
+static uint64_t
+hash64(const void *data, size_t len, uint64_t h)
+{
+	const unsigned char *p = data;
+	uint64_t w;
+
+	h ^= 0xcbf29ce484222325ULL;
+
+	for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h ^= w;
+		h *= 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+	}
+
+	for (; len; p++, len--) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* growable output buffer, for building binary files in memory */
+struct wbuf {
+	char *p;
+	size_t n, cap;
+};
+
 static void
-read_word(char *buf, char **input, size_t max_len)
+wb_put(struct wbuf *wb, const void *data, size_t len)
 {
-	size_t ret = 0;
-	char *inp = *input;
+	if (wb->n + len > wb->cap) {
+		wb->cap = (wb->n + len) * 2;
+		wb->p = realloc(wb->p, wb->cap);
+		CBUG(!wb->p);
+	}
 
-	for (; *inp && isspace(*inp); inp++, ret++);
+	memcpy(wb->p + wb->n, data, len);
+	wb->n += len;
+}
 
-	for (; *inp && !isspace(*inp) && ret < max_len; inp++, buf++, ret++)
-		*buf = *inp;
+/* input buffer, for reading binary files from memory */
+struct rbuf {
+	char *p, *end;
+};
 
-	*buf = '\0';
+static int
+rb_get(struct rbuf *rb, void *data, size_t len)
+{
+	if ((size_t) (rb->end - rb->p) < len)
+		return -1;
 
-	*input += ret;
+	memcpy(data, rb->p, len);
+	rb->p += len;
+	return 0;
 }
 
-/* read date in iso 8601 and convert it to a unix timestamp */
-static inline time_t
-read_ts(char **line)
+/* skip n things of size bytes each. Returns -1 if there aren't that many */
+static int
+rb_skip(struct rbuf *rb, uint64_t n, size_t size)
 {
-	char buf[DATE_MAX_LEN];
-	read_word(buf, line, sizeof(buf));
-	return sscantime(buf);
+	if (size && n > (size_t) (rb->end - rb->p) / size)
+		return -1;
+
+	rb->p += n * size;
+	return 0;
+}
+
+/* read a whole stream into memory. One extra byte is allocated so that the
+ * caller can always NUL terminate at buf[len]. */
+static char *
+slurp(FILE *fp, size_t *len)
+{
+	size_t cap = BUFSIZ, ret;
+	char *buf = malloc(cap + 1);
+
+	CBUG(!buf);
+	*len = 0;
+
+	while ((ret = fread(buf + *len, 1, cap - *len, fp)) > 0) {
+		*len += ret;
+		if (*len < cap)
+			continue;
+		cap *= 2;
+		buf = realloc(buf, cap + 1);
+		CBUG(!buf);
+	}
+
+	buf[*len] = '\0';
+	return buf;
+}
+
+/* seconds since some fixed point in the past, for measuring how long things
+ * take (not affected by changes to the system's clock) */
+static inline double
+clock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/******
+ * names (interned nicknames)
+ ******/
+
+/* Each distinct nickname gets a small number, in the order they are first
+ * seen, so that the rest of the program can refer to them without comparing
+ * strings. They are kept one after the other in a single buffer (the arena),
+ * and found through an open addressing hash table.
+ */
+
+struct names {
+	char *arena;
+	size_t arena_n, arena_cap;
+	size_t *off; // by name, where it starts in the arena
+	unsigned n, cap;
+	unsigned *tab; // by hash, name + 1, or 0 if the slot is empty
+	unsigned mask;
+};
+
+static inline char *
+names_str(struct names *nm, unsigned i)
+{
+	return nm->arena + nm->off[i];
+}
+
+static void
+names_grow(struct names *nm)
+{
+	unsigned i, j, cap = nm->mask ? (nm->mask + 1) * 2 : 64;
+
+	free(nm->tab);
+	nm->tab = calloc(cap, sizeof(unsigned));
+	CBUG(!nm->tab);
+	nm->mask = cap - 1;
+
+	for (i = 0; i < nm->n; i++) {
+		char *s = names_str(nm, i);
+		j = hash64(s, strlen(s), 0) & nm->mask;
+		for (; nm->tab[j]; j = (j + 1) & nm->mask);
+		nm->tab[j] = i + 1;
+	}
+}
+
+/* get the number of a nickname, adding it if it wasn't seen before */
+static unsigned
+names_get(struct names *nm, char *s, size_t len)
+{
+	unsigned i, j;
+
+	if (len >= USERNAME_MAX_LEN)
+		len = USERNAME_MAX_LEN - 1;
+
+	if (nm->n * 2 >= nm->mask)
+		names_grow(nm);
+
+	j = hash64(s, len, 0) & nm->mask;
+	for (; (i = nm->tab[j]); j = (j + 1) & nm->mask) {
+		char *o = names_str(nm, i - 1);
+		if (!strncmp(o, s, len) && !o[len])
+			return i - 1;
+	}
+
+	if (nm->n >= nm->cap) {
+		nm->cap = nm->cap ? nm->cap * 2 : 64;
+		nm->off = realloc(nm->off, nm->cap * sizeof(size_t));
+		CBUG(!nm->off);
+	}
+
+	if (nm->arena_n + len + 1 > nm->arena_cap) {
+		nm->arena_cap = (nm->arena_n + len + 1) * 2;
+		nm->arena = realloc(nm->arena, nm->arena_cap);
+		CBUG(!nm->arena);
+	}
+
+	nm->off[nm->n] = nm->arena_n;
+	memcpy(nm->arena + nm->arena_n, s, len);
+	nm->arena_n += len;
+	nm->arena[nm->arena_n++] = '\0';
+	nm->tab[j] = ++nm->n;
+	return nm->n - 1;
+}
+
+static void
+names_free(struct names *nm)
+{
+	free(nm->arena);
+	free(nm->off);
+	free(nm->tab);
+	memset(nm, 0, sizeof(*nm));
+}
+
+/******
+ * bitsets (sets of small numbers, like ids)
+ ******/
+
+struct bits {
+	uint64_t *w;
+	size_t n; // words
+};
+
+static inline int
+bits_get(struct bits *b, unsigned i)
+{
+	return i / 64 < b->n && (b->w[i / 64] >> i % 64 & 1);
+}
+
+static inline void
+bits_set(struct bits *b, unsigned i)
+{
+	if (i / 64 >= b->n) {
+		size_t n = (i / 64 + 1) * 2;
+		b->w = realloc(b->w, n * sizeof(uint64_t));
+		CBUG(!b->w);
+		memset(b->w + b->n, 0, (n - b->n) * sizeof(uint64_t));
+		b->n = n;
+	}
+
+	b->w[i / 64] |= 1ULL << i % 64;
+}
+
+static inline void
+bits_clr(struct bits *b, unsigned i)
+{
+	if (i / 64 < b->n)
+		b->w[i / 64] &= ~(1ULL << i % 64);
+}
+
+/* Find the first number in the set that is i or above, and put it in i.
+ * Returns 0 if there are none. To go through all of them, in order:
+ *
+ * for (i = 0; bits_next(b, &i); i++)
+ */
+static inline int
+bits_next(struct bits *b, unsigned *i)
+{
+	size_t k = *i / 64;
+	uint64_t w;
+
+	if (k >= b->n)
+		return 0;
+
+	for (w = b->w[k] & (~0ULL << *i % 64); !w; w = b->w[k])
+		if (++k >= b->n)
+			return 0;
+
+	*i = k * 64 + __builtin_ctzll(w);
+	return 1;
+}
+
+/******
+ * events (lines that were parsed, but not yet applied)
+ ******/
+
+enum op_kind {
+	OP_START,
+	OP_STOP,
+	OP_PAUSE,
+	OP_RESUME,
+	OP_TRANSFER,
+	OP_PAY,
+	OP_BUY,
+	OP_MAX,
+};
+
+static char *op_names[] = {
+	"START", "STOP", "PAUSE", "RESUME", "TRANSFER", "PAY", "BUY",
+};
+
+/* Everything a line says, in a form that is quick to work with. Which fields
+ * are used depends on the kind of operation, for example only TRANSFER has
+ * who2, and only PAY has a billing period (min and max). rest and end point
+ * to what remains of the line in the input (comments), for debug messages,
+ * or if err is set, to what is wrong with it.
+ */
+struct ev {
+	unsigned char op, err; // err is an enum parse_err
+	unsigned line;
+	time_t ts, min, max;
+	unsigned who, who2;
+	int64_t value; // cents
+	char *rest, *end;
+};
+
+/* Find out the kind of operation from its name, OP_MAX if it's not one.
+ * Names have different lengths (or, if not, different first letters), so
+ * that is enough to know which one it can be, and then we only have to
+ * compare with that one. */
+static inline unsigned
+op_kind(char *s, size_t len)
+{
+	unsigned op;
+
+	switch (len) {
+	case 3: op = s[0] == 'P' ? OP_PAY : OP_BUY; break;
+	case 4: op = OP_STOP; break;
+	case 5: op = s[0] == 'S' ? OP_START : OP_PAUSE; break;
+	case 6: op = OP_RESUME; break;
+	case 8: op = OP_TRANSFER; break;
+	default: return OP_MAX;
+	}
+
+	return memcmp(s, op_names[op], len) ? OP_MAX : op;
+}
+
+/* read person nickname, and intern it */
+static inline unsigned
+read_name(struct names *nm, char **line, char *end)
+{
+	size_t len;
+	char *tok = read_tok(line, end, &len);
+	return names_get(nm, tok, len);
+}
+
+static inline int
+ev_error(struct ev *ev, int err, char *tok, char *end)
+{
+	ev->err = err;
+	ev->rest = tok;
+	ev->end = end;
+	return -1;
+}
+
+/* Parse a line into an event. It returns 0 if the line is not an event (if
+ * it is empty, a comment, or of an unknown type), in which case it is to be
+ * ignored, or -1 if something in it is wrong (see ev_fail). Nicknames are
+ * interned in nm. */
+static int
+ev_parse(struct ev *ev, struct names *nm, char *line, char *end)
+{
+	size_t len;
+	char *tok;
+	int err;
+
+	if (line >= end || line[0] == '#' || line[0] == '\n')
+		return 0;
+
+	tok = read_tok(&line, end, &len);
+	ev->op = op_kind(tok, len);
+	if (ev->op >= OP_MAX)
+		return 0;
+
+	ev->err = PE_OK;
+	tok = line;
+	if ((err = read_ts(&line, end, &ev->ts)))
+		return ev_error(ev, err, tok, line);
+
+	ev->who = read_name(nm, &line, end);
+
+	switch (ev->op) {
+	case OP_TRANSFER:
+		ev->who2 = read_name(nm, &line, end);
+		tok = line;
+		if ((err = read_currency(&line, end, &ev->value)))
+			return ev_error(ev, err, tok, line);
+		break;
+	case OP_PAY:
+		tok = line;
+		if ((err = read_currency(&line, end, &ev->value)))
+			return ev_error(ev, err, tok, line);
+		tok = line;
+		if ((err = read_ts(&line, end, &ev->min)))
+			return ev_error(ev, err, tok, line);
+		tok = line;
+		if ((err = read_ts(&line, end, &ev->max)))
+			return ev_error(ev, err, tok, line);
+		break;
+	case OP_BUY:
+		tok = line;
+		if ((err = read_currency(&line, end, &ev->value)))
+			return ev_error(ev, err, tok, line);
+		break;
+	}
+
+	ev->rest = line;
+	ev->end = end;
+	return 1;
+}
+
+/* say what is wrong with a line (an event with err set), and exit */
+static void
+ev_fail(struct ev *ev)
+{
+	char *tok = ev->rest;
+
+	for (; tok < ev->end && is_space(*tok); tok++);
+	fprintf(stderr, "line %u: %s: \"%.*s\"\n", ev->line,
+			parse_errs[ev->err], (int) (ev->end - tok), tok);
+	exit(EXIT_FAILURE);
+}
+
+/******
+ * compiled ledgers (the format is described in sem-compile.c)
+ ******/
+
+#define BIN_MAGIC "SEMBIN"
+#define BIN_VERSION 1
+#define BIN_BLOCK 65536
+
+enum bin_col {
+	BC_OP,
+	BC_LINE,
+	BC_TS,
+	BC_WHO,
+	BC_WHO2,
+	BC_VALUE,
+	BC_MIN,
+	BC_MAX,
+	BC_MAX_COL,
+};
+
+struct bin_hdr {
+	char magic[8];
+	uint32_t version, block;
+};
+
+static inline uint64_t
+zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t
+unzigzag(uint64_t v)
+{
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/* write an unsigned integer, 7 bits per byte, high bit set if more follow */
+static inline void
+varint_put(struct wbuf *wb, uint64_t v)
+{
+	unsigned char buf[10], *p = buf;
+
+	for (; v >= 0x80; v >>= 7)
+		*p++ = v | 0x80;
+	*p++ = v;
+
+	wb_put(wb, buf, p - buf);
+}
+
+static inline int
+varint_get(struct rbuf *rb, uint64_t *v)
+{
+	unsigned char *p = (unsigned char *) rb->p;
+	unsigned shift = 0;
+
+	*v = 0;
+	for (; p < (unsigned char *) rb->end && shift < 64; shift += 7) {
+		*v |= (uint64_t) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			rb->p = (char *) p;
+			return 0;
+		}
+	}
+
+	return -1;
 }
 
-#endif
+#endif
\ No newline at end of file
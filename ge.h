@@ -0,0 +1,319 @@
+#ifndef GE_H
+#define GE_H
+
+/* ge (graph edges): the debt between each pair of people.
+ *
+ * For a pair of numeric ids (lo, hi), with lo < hi, we keep a single value:
+ * how much hi owes lo (negative if it's lo that owes hi). Since ids are
+ * handed out one after the other, they are small and dense, so while there
+ * are not many people we keep these in a triangular array, where the row of
+ * hi has one value for each lo below it:
+ *
+ *        lo 0   1   2
+ * hi 1     v
+ * hi 2     v   v
+ * hi 3     v   v   v
+ *
+ * Rows are one after the other, so the row of hi starts at hi * (hi - 1) / 2,
+ * and making room for more people just means making the array longer. We
+ * also keep one bit per pair, to know which pairs ever had debt between them
+ * (even if it went back to zero).
+ *
+ * This takes memory proportional to the square of the number of people, so
+ * once someone has an id of GE_DENSE_MAX or above, we switch to a hash table
+ * (open addressing) that only has the pairs that have debt.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#ifndef GE_DENSE_MAX
+#define GE_DENSE_MAX 2048
+#endif
+
+struct ge_pair {
+	uint64_t key; // hi << 32 | lo, 0 if empty (lo < hi, so never 0)
+	int64_t value;
+};
+
+struct ge {
+	int sparse;
+
+	/* dense */
+	int64_t *tri;
+	uint64_t *set;
+	unsigned n; // rows (people) that fit
+	size_t set_n; // words in set
+
+	/* sparse */
+	struct ge_pair *tab;
+	size_t tab_n, mask;
+};
+
+struct ge_cur {
+	size_t pos;
+	unsigned lo, hi;
+};
+
+static inline size_t
+ge_tri(unsigned lo, unsigned hi)
+{
+	return (size_t) hi * (hi - 1) / 2 + lo;
+}
+
+static inline uint64_t
+ge_key(unsigned lo, unsigned hi)
+{
+	return (uint64_t) hi << 32 | lo;
+}
+
+/* find the slot of a pair in the hash table (or where it would go) */
+static inline struct ge_pair *
+ge_slot(struct ge *ge, uint64_t key)
+{
+	size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 20 & ge->mask;
+
+	for (; ge->tab[i].key && ge->tab[i].key != key; i = (i + 1) & ge->mask);
+
+	return &ge->tab[i];
+}
+
+static void
+ge_sparse_grow(struct ge *ge)
+{
+	struct ge_pair *old = ge->tab;
+	size_t i, n = ge->mask ? ge->mask + 1 : 0, cap = n ? n * 2 : 1024;
+
+	ge->tab = calloc(cap, sizeof(struct ge_pair));
+	CBUG(!ge->tab);
+	ge->mask = cap - 1;
+
+	for (i = 0; i < n; i++)
+		if (old[i].key)
+			*ge_slot(ge, old[i].key) = old[i];
+
+	free(old);
+}
+
+/* move all pairs from the triangular array into the hash table */
+static void
+ge_to_sparse(struct ge *ge)
+{
+	unsigned lo, hi;
+	size_t i;
+
+	ge->sparse = 1;
+	ge_sparse_grow(ge);
+
+	for (hi = 1; hi < ge->n; hi++)
+		for (lo = 0; lo < hi; lo++) {
+			i = ge_tri(lo, hi);
+			if (!(ge->set[i / 64] & (1ULL << i % 64)))
+				continue;
+			if (ge->tab_n * 2 >= ge->mask)
+				ge_sparse_grow(ge);
+			struct ge_pair *p = ge_slot(ge, ge_key(lo, hi));
+			p->key = ge_key(lo, hi);
+			p->value = ge->tri[i];
+			ge->tab_n++;
+		}
+
+	free(ge->tri);
+	free(ge->set);
+	ge->tri = NULL;
+	ge->set = NULL;
+	ge->n = 0;
+	ge->set_n = 0;
+}
+
+/* make room in the triangular array for ids below n */
+static void
+ge_dense_grow(struct ge *ge, unsigned n)
+{
+	size_t old = ge->n ? ge_tri(0, ge->n) : 0, len, set_n;
+
+	if (n < 64)
+		n = 64;
+	else
+		n = n > GE_DENSE_MAX / 2 ? GE_DENSE_MAX : n * 2;
+
+	len = ge_tri(0, n);
+	set_n = len / 64 + 1;
+	ge->tri = realloc(ge->tri, len * sizeof(int64_t));
+	CBUG(!ge->tri);
+	ge->set = realloc(ge->set, set_n * sizeof(uint64_t));
+	CBUG(!ge->set);
+	memset(ge->tri + old, 0, (len - old) * sizeof(int64_t));
+	memset(ge->set + ge->set_n, 0, (set_n - ge->set_n) * sizeof(uint64_t));
+	ge->n = n;
+	ge->set_n = set_n;
+}
+
+/* get where the debt between lo and hi is, making room for it if needed */
+static inline int64_t *
+ge_ref(struct ge *ge, unsigned lo, unsigned hi)
+{
+	size_t i;
+
+	if (!ge->sparse && hi >= ge->n) {
+		if (hi >= GE_DENSE_MAX)
+			ge_to_sparse(ge);
+		else
+			ge_dense_grow(ge, hi + 1);
+	}
+
+	if (ge->sparse) {
+		uint64_t key = ge_key(lo, hi);
+		struct ge_pair *p;
+
+		if (ge->tab_n * 2 >= ge->mask)
+			ge_sparse_grow(ge);
+
+		p = ge_slot(ge, key);
+		if (!p->key) {
+			p->key = key;
+			ge->tab_n++;
+		}
+		return &p->value;
+	}
+
+	i = ge_tri(lo, hi);
+	ge->set[i / 64] |= 1ULL << i % 64;
+	return &ge->tri[i];
+}
+
+/* get debt between people (how much id1 owes id0) */
+static inline int64_t
+ge_get(struct ge *ge, unsigned id0, unsigned id1)
+{
+	unsigned lo = id0 < id1 ? id0 : id1, hi = id0 < id1 ? id1 : id0;
+	int64_t ret;
+
+	if (ge->sparse) {
+		struct ge_pair *p;
+
+		if (!ge->mask)
+			return 0;
+		p = ge_slot(ge, ge_key(lo, hi));
+		ret = p->key ? p->value : 0;
+	} else
+		ret = hi < ge->n ? ge->tri[ge_tri(lo, hi)] : 0;
+
+	return id0 > id1 ? -ret : ret;
+}
+
+/* add debt between people (id_to owes id_from value more) */
+static inline void
+ge_add(struct ge *ge, unsigned id_from, unsigned id_to, int64_t value)
+{
+	if (id_from > id_to)
+		*ge_ref(ge, id_to, id_from) -= value;
+	else
+		*ge_ref(ge, id_from, id_to) += value;
+}
+
+/* Add owe[i] to what who[i] owes id, for each of the n of them. This is what
+ * ge_add does, but growing the array only once, and without finding the row
+ * of id each time: in the triangular array, pairs where id is hi are all in
+ * its row, one after the other. */
+static inline void
+ge_add_row(struct ge *ge, unsigned id, unsigned *who, int64_t *owe,
+		unsigned n)
+{
+	unsigned i, hi = id;
+	size_t base, k;
+
+	for (i = 0; i < n; i++)
+		if (who[i] > hi)
+			hi = who[i];
+
+	if (!ge->sparse && hi >= ge->n) {
+		if (hi >= GE_DENSE_MAX)
+			ge_to_sparse(ge);
+		else
+			ge_dense_grow(ge, hi + 1);
+	}
+
+	if (ge->sparse) {
+		for (i = 0; i < n; i++)
+			ge_add(ge, id, who[i], owe[i]);
+		return;
+	}
+
+	base = ge_tri(0, id);
+	for (i = 0; i < n; i++) {
+		if (who[i] < id) {
+			k = base + who[i];
+			ge->tri[k] -= owe[i];
+		} else {
+			k = ge_tri(id, who[i]);
+			ge->tri[k] += owe[i];
+		}
+		ge->set[k / 64] |= 1ULL << k % 64;
+	}
+}
+
+static inline struct ge_cur
+ge_iter(struct ge *ge)
+{
+	struct ge_cur c = { 0, 0, 1 };
+
+	(void) ge;
+	return c;
+}
+
+/* go through all pairs that ever had debt, lo < hi */
+static inline int
+ge_next(struct ge *ge, unsigned *lo, unsigned *hi, int64_t *value,
+		struct ge_cur *c)
+{
+	if (ge->sparse) {
+		for (; c->pos <= ge->mask; c->pos++)
+			if (ge->tab[c->pos].key) {
+				*lo = ge->tab[c->pos].key & 0xffffffff;
+				*hi = ge->tab[c->pos].key >> 32;
+				*value = ge->tab[c->pos++].value;
+				return 1;
+			}
+		return 0;
+	}
+
+	/* pos follows (lo, hi), row by row */
+	for (; c->hi < ge->n; c->hi++, c->lo = 0)
+		for (; c->lo < c->hi; c->lo++, c->pos++)
+			if (ge->set[c->pos / 64] & (1ULL << c->pos % 64)) {
+				*lo = c->lo++;
+				*hi = c->hi;
+				*value = ge->tri[c->pos++];
+				return 1;
+			}
+
+	return 0;
+}
+
+/* add all the debt in src to dst (and every pair that had debt in src will
+ * have had it in dst) */
+static inline void
+ge_merge(struct ge *dst, struct ge *src)
+{
+	struct ge_cur c = ge_iter(src);
+	unsigned lo, hi;
+	int64_t value;
+
+	while (ge_next(src, &lo, &hi, &value, &c))
+		ge_add(dst, lo, hi, value);
+}
+
+static inline void
+ge_free(struct ge *ge)
+{
+	free(ge->tri);
+	free(ge->set);
+	free(ge->tab);
+	memset(ge, 0, sizeof(*ge));
+}
+
+#endif
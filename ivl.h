@@ -0,0 +1,718 @@
+#ifndef IVL_H
+#define IVL_H
+
+/* ivl (interval logs): who was there when. sem keeps two of them, one for
+ * who is present (p_log) and one for who is renting (np_log), and this is
+ * apart from sem.c so that sem-micro can measure it.
+ *
+ * Each of the BSTs is an interval log: an array with every interval that was
+ * started, sorted by min (they almost always come in that order, so adding
+ * one is just putting it at the end). An interval that hasn't finished yet
+ * has TS_OPEN as its max, and the "last" array tells us (by numeric id) where
+ * the latest interval of a person is, so that we can finish it (or, with
+ * "-m", start it again, see ivl_merge) without searching. Having them all in
+ * an array also makes it easy to save them to a checkpoint and load them
+ * back.
+ *
+ * To find the intervals that overlap a period of time, there is a tree on top
+ * of the array (ends). It is a complete binary tree, also in an array, with
+ * the root at 1 and the children of k at 2k and 2k + 1 (like a heap). Its
+ * leaves are the intervals, in order, and each node has the greatest max of
+ * the intervals below it. Since the intervals are sorted by min, those that
+ * start before a time are the first ones, and among them, we can skip all
+ * that are below a node that ends before the time we want (see ivt_find).
+ *
+ * Built with USE_LIBIT, the intervals also go into libit's BSTs, which are
+ * then asked instead of the tree, to compare with.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#define TS_OPEN ((time_t) INT64_MAX)
+#define TS_NONE ((time_t) INT64_MIN) // the max of leaves with no interval
+
+struct ivl {
+	time_t min, max;
+	unsigned id;
+};
+
+/* Each log also keeps who was there as a timeline: a list of the moments
+ * when that changed (change points), in date order, each with the set of ids
+ * that were there from then on, and how many they were. This is what op_pay
+ * and op_buy look at, instead of asking the BSTs (see ivl_iter).
+ *
+ * To save memory, a set only keeps its words from the first to the last one
+ * that isn't zero, and these are all in one big array (pool).
+ *
+ * Each point also has the prefix integral (g) of 1 / count, from the first
+ * point until it: how much of a bill someone would pay, if they were there
+ * all that time, in seconds of the bill. So what someone who was there from
+ * a to b pays is g(b) - g(a), however many points are in between (see
+ * pay_prefix). It is kept as a whole number, multiplied by G_SCALE, which
+ * every count from 1 to 16 divides (so with up to 16 people there at once,
+ * nothing is lost).
+ */
+
+#define G_SCALE 720720
+
+struct tl_point {
+	time_t ts;
+	unsigned count; // ids in the set
+	unsigned lo, n; // the set is words lo to lo + n - 1 (the rest are 0)
+	size_t off; // where those words are in the pool
+	int64_t g; // the prefix integral up to ts (see tl_integral)
+};
+
+struct timeline {
+	struct tl_point *v;
+	size_t n, cap;
+	uint64_t *pool;
+	size_t pool_n, pool_cap;
+	struct bits cur; // who is there after the last change point
+	unsigned count;
+	int unordered; // a change came before the last point
+	size_t frozen; // points before this one can't change (see pend_add)
+};
+
+struct ivlog {
+	struct ivl *v;
+	size_t n, cap;
+	time_t *ends; // the tree
+	size_t leaves; // in the tree (a power of two, at least n)
+	size_t *last; // by id, index + 1 of its latest interval, or 0
+	unsigned last_n;
+	struct timeline tl;
+	void (*touch)(time_t ts); // someone started or stopped at ts (or NULL)
+#ifdef USE_LIBIT
+	unsigned itd;
+#endif
+};
+
+/* the prefix integral at ts (which is at or after point pt, and before the
+ * next one) */
+static inline int64_t
+tl_g(struct tl_point *pt, time_t ts)
+{
+	return pt->g + (pt->count ? (ts - pt->ts) * G_SCALE / pt->count : 0);
+}
+
+/* write down that, from ts on, who is there is what is in tl->cur */
+static void
+tl_mark(struct timeline *tl, time_t ts)
+{
+	struct tl_point *pt;
+	size_t lo, hi;
+
+	if (tl->n && tl->v[tl->n - 1].ts > ts) {
+		/* we can't go back and change the points after ts, so we
+		 * stop using the timeline, and ask the BSTs instead */
+		tl->unordered = 1;
+		return;
+	}
+
+	if (tl->n > tl->frozen && tl->v[tl->n - 1].ts == ts) {
+		/* many changes at the same time are a single point. Its
+		 * words are the last ones in the pool, so we write over them.
+		 * Unless it is frozen, then we add another one, with the same
+		 * time, and the last one is the one that counts */
+		pt = &tl->v[tl->n - 1];
+		tl->pool_n = pt->off;
+	} else {
+		if (tl->n >= tl->cap) {
+			tl->cap = tl->cap ? tl->cap * 2 : 64;
+			tl->v = realloc(tl->v, tl->cap * sizeof(struct tl_point));
+			CBUG(!tl->v);
+		}
+		pt = &tl->v[tl->n++];
+		pt->ts = ts;
+		pt->g = tl->n > 1 ? tl_g(pt - 1, ts) : 0;
+	}
+
+	for (lo = 0; lo < tl->cur.n && !tl->cur.w[lo]; lo++);
+	for (hi = tl->cur.n; hi > lo && !tl->cur.w[hi - 1]; hi--);
+
+	if (tl->pool_n + hi - lo > tl->pool_cap) {
+		tl->pool_cap = (tl->pool_n + hi - lo) * 2;
+		tl->pool = realloc(tl->pool, tl->pool_cap * sizeof(uint64_t));
+		CBUG(!tl->pool);
+	}
+
+	memcpy(tl->pool + tl->pool_n, tl->cur.w + lo,
+			(hi - lo) * sizeof(uint64_t));
+	pt->count = tl->count;
+	pt->lo = lo;
+	pt->n = hi - lo;
+	pt->off = tl->pool_n;
+	tl->pool_n += hi - lo;
+}
+
+static inline void
+tl_start(struct timeline *tl, time_t ts, unsigned id)
+{
+	if (bits_get(&tl->cur, id))
+		return;
+	bits_set(&tl->cur, id);
+	tl->count++;
+	tl_mark(tl, ts);
+}
+
+static inline void
+tl_stop(struct timeline *tl, time_t ts, unsigned id)
+{
+	if (!bits_get(&tl->cur, id))
+		return;
+	bits_clr(&tl->cur, id);
+	tl->count--;
+	tl_mark(tl, ts);
+}
+
+/* index + 1 of the last point at or before ts, out of the first n (0 if
+ * there is none) */
+static inline size_t
+tl_find(struct timeline *tl, size_t n, time_t ts)
+{
+	size_t lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tl->v[mid].ts <= ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* the prefix integral at ts */
+static inline int64_t
+tl_integral(struct timeline *tl, time_t ts)
+{
+	size_t i = tl_find(tl, tl->n, ts);
+
+	return i ? tl_g(&tl->v[i - 1], ts) : 0;
+}
+
+/* how many intervals start at or before ts */
+static inline size_t
+ivl_count(struct ivlog *log, time_t ts)
+{
+	size_t lo = 0, hi = log->n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (log->v[mid].min <= ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* build the tree from scratch (making room for all intervals) */
+static void
+ivt_build(struct ivlog *log)
+{
+	time_t *e;
+	size_t k, n = log->leaves ? log->leaves : 64;
+
+	while (n < log->n)
+		n *= 2;
+
+	if (n != log->leaves) {
+		log->ends = realloc(log->ends, 2 * n * sizeof(time_t));
+		CBUG(!log->ends);
+		log->leaves = n;
+	}
+
+	e = log->ends;
+	for (k = 0; k < n; k++)
+		e[n + k] = k < log->n ? log->v[k].max : TS_NONE;
+	for (k = n - 1; k; k--)
+		e[k] = e[2 * k] > e[2 * k + 1] ? e[2 * k] : e[2 * k + 1];
+}
+
+/* the max of interval i changed (or it's a new one, at the end) */
+static inline void
+ivt_set(struct ivlog *log, size_t i)
+{
+	time_t *e = log->ends;
+	size_t k;
+
+	if (i >= log->leaves) {
+		ivt_build(log);
+		return;
+	}
+
+	k = log->leaves + i;
+	e[k] = log->v[i].max;
+	for (k /= 2; k; k /= 2)
+		e[k] = e[2 * k] > e[2 * k + 1] ? e[2 * k] : e[2 * k + 1];
+}
+
+/* start an interval [ts, +∞] for id in its log */
+static void
+ivl_start(struct ivlog *log, time_t ts, unsigned id)
+{
+	size_t i, j;
+
+#ifdef USE_LIBIT
+	it_start(log->itd, ts, id);
+#endif
+
+	if (log->n >= log->cap) {
+		log->cap = log->cap ? log->cap * 2 : 64;
+		log->v = realloc(log->v, log->cap * sizeof(struct ivl));
+		CBUG(!log->v);
+	}
+
+	if (id >= log->last_n) {
+		unsigned n = (id + 1) * 2;
+		log->last = realloc(log->last, n * sizeof(size_t));
+		CBUG(!log->last);
+		memset(log->last + log->last_n, 0,
+				(n - log->last_n) * sizeof(size_t));
+		log->last_n = n;
+	}
+
+	/* it goes at the end, unless lines are not in date order. Then the
+	 * ones after it move one place, and so do their last slots */
+	i = log->n && log->v[log->n - 1].min > ts ? ivl_count(log, ts) : log->n;
+	memmove(log->v + i + 1, log->v + i, (log->n - i) * sizeof(struct ivl));
+	for (j = i + 1; j <= log->n; j++)
+		if (log->last[log->v[j].id] == j)
+			log->last[log->v[j].id] = j + 1;
+
+	log->v[i].min = ts;
+	log->v[i].max = TS_OPEN;
+	log->v[i].id = id;
+	log->last[id] = i + 1;
+
+	if (i < log->n++)
+		ivt_build(log);
+	else
+		ivt_set(log, i);
+
+	tl_start(&log->tl, ts, id);
+	if (log->touch)
+		log->touch(ts);
+}
+
+/* finish the open interval of id at ts */
+static void
+ivl_stop(struct ivlog *log, time_t ts, unsigned id)
+{
+	size_t i;
+
+#ifdef USE_LIBIT
+	it_stop(log->itd, ts, id);
+#endif
+
+	if (id >= log->last_n || !log->last[id]
+			|| log->v[log->last[id] - 1].max != TS_OPEN)
+		return;
+
+	i = log->last[id] - 1;
+	log->v[i].max = ts;
+	ivt_set(log, i);
+	tl_stop(&log->tl, ts, id);
+	if (log->touch)
+		log->touch(ts);
+}
+
+/* intervals found by ivt_find (indexes in the log) */
+struct ivt_res {
+	size_t *v, n, cap;
+};
+
+/* Add to r the intervals (among the first hi) that end after ts, and that
+ * are below node k of the tree (which has the leaves from lo to
+ * lo + len - 1), in order */
+static void
+ivt_find(struct ivlog *log, struct ivt_res *r, size_t k, size_t lo,
+		size_t len, size_t hi, time_t ts)
+{
+	if (lo >= hi || log->ends[k] <= ts)
+		return;
+
+	if (len > 1) {
+		ivt_find(log, r, 2 * k, lo, len / 2, hi, ts);
+		ivt_find(log, r, 2 * k + 1, lo + len / 2, len / 2, hi, ts);
+		return;
+	}
+
+	if (r->n >= r->cap) {
+		r->cap = r->cap ? r->cap * 2 : 16;
+		r->v = realloc(r->v, r->cap * sizeof(size_t));
+		CBUG(!r->v);
+	}
+
+	r->v[r->n++] = lo;
+}
+
+/* id stopped being there at t (the last time it changed), and is there
+ * again now: make it as if it had never left, changing the points from t on.
+ * Their words are copied to the end of the pool (so that the last point's
+ * are still the last ones), with the one of id. Then the point at t can be
+ * the same as the one before it, and unless keep is set (some other
+ * interval starts or ends at t, so the BST would split there too), we take
+ * it out, so that bills don't have a segment that starts there. Returns 0 if
+ * some of them are frozen */
+static int
+tl_unstop(struct timeline *tl, time_t t, unsigned id, int keep)
+{
+	size_t i = tl_find(tl, tl->n, t - 1), j;
+	unsigned w = id / 64, lo, hi;
+	struct tl_point *pt, *a, *b;
+
+	if (i < tl->frozen)
+		return 0;
+
+	bits_set(&tl->cur, id);
+	tl->count++;
+	if (tl->unordered)
+		return 1;
+
+	for (j = i; j < tl->n; j++) {
+		pt = &tl->v[j];
+		lo = pt->n && pt->lo < w ? pt->lo : w;
+		hi = pt->n && pt->lo + pt->n > w + 1 ? pt->lo + pt->n : w + 1;
+
+		if (tl->pool_n + hi - lo > tl->pool_cap) {
+			tl->pool_cap = (tl->pool_n + hi - lo) * 2;
+			tl->pool = realloc(tl->pool,
+					tl->pool_cap * sizeof(uint64_t));
+			CBUG(!tl->pool);
+		}
+
+		memset(tl->pool + tl->pool_n, 0, (hi - lo) * sizeof(uint64_t));
+		memcpy(tl->pool + tl->pool_n + pt->lo - lo, tl->pool + pt->off,
+				pt->n * sizeof(uint64_t));
+		tl->pool[tl->pool_n + w - lo] |= 1ULL << (id % 64);
+		pt->off = tl->pool_n;
+		pt->lo = lo;
+		pt->n = hi - lo;
+		pt->count++;
+		pt->g = j ? tl_g(pt - 1, pt->ts) : 0;
+		tl->pool_n += hi - lo;
+	}
+
+	/* (if there are many points at t, the last one is the one that
+	 * counts, see tl_mark) */
+	j = tl_find(tl, tl->n, t);
+	if (keep || !i || j <= i)
+		return 1;
+
+	a = &tl->v[i - 1];
+	b = &tl->v[j - 1];
+	if (a->count == b->count && a->lo == b->lo && a->n == b->n
+			&& !memcmp(tl->pool + a->off, tl->pool + b->off,
+				a->n * sizeof(uint64_t))) {
+		memmove(tl->v + i, tl->v + j,
+				(tl->n - j) * sizeof(struct tl_point));
+		tl->n -= j - i;
+	}
+
+	return 1;
+}
+
+/* if an interval starts or ends at t */
+static int
+ivl_ends_at(struct ivlog *log, time_t t)
+{
+	static struct ivt_res r;
+	size_t hi = ivl_count(log, t), i;
+
+	if (hi > ivl_count(log, t - 1))
+		return 1;
+
+	r.n = 0;
+	if (log->leaves)
+		ivt_find(log, &r, 1, 0, log->leaves, hi, t - 1);
+	for (i = 0; i < r.n; i++)
+		if (log->v[r.v[i]].max == t)
+			return 1;
+
+	return 0;
+}
+
+/* Going through who was there from min to max, like it_iter and it_next do
+ * with a BST. The time from min to max is split into segments at each change
+ * point, and for each segment in which someone was there, we get its start,
+ * its end, how many were there, and (one at a time, by id) who. If min and
+ * max are the same, we get who was there at that moment.
+ *
+ * Finding the segment min is in takes a binary search, and the rest is just
+ * going forward in the timeline. If it can't be used (see tl_mark), or sem
+ * was built with IT_QUERY, we ask the BST (see ivt_iter).
+ *
+ * tl_iter does the same, but only looking at the first n points of the
+ * timeline (what it was like when a line was read, see pend_add).
+ */
+struct memo;
+
+struct ivl_cur {
+	struct timeline *tl;
+	size_t n; // points we can look at
+	size_t i; // index + 1 of the point the segment starts at, or 0
+	time_t a, b, max; // the segment, and where to stop
+	unsigned k; // word of the set we are in
+	uint64_t w; // the ids in it that we haven't gone through yet
+	int use_it; // asking the BST instead
+	struct memo *m; // or going through what we remembered (see memo_iter)
+	unsigned m_s, m_w; // segment, and who in it
+#ifdef USE_LIBIT
+	it_cur_t it;
+#else
+	struct ivlog *log;
+	struct ivt_res r; // intervals found
+	size_t r_i;
+	time_t *pt; // where segments start and end
+	size_t pt_n, pt_i;
+	unsigned count; // intervals in the segment
+	int point; // min and max are the same
+#endif
+};
+
+static inline void
+tl_load(struct ivl_cur *c)
+{
+	struct tl_point *pt;
+
+	c->k = 0;
+	c->w = 0;
+	if (!c->i)
+		return;
+	pt = &c->tl->v[c->i - 1];
+	if (pt->n)
+		c->w = c->tl->pool[pt->off];
+}
+
+static inline struct ivl_cur
+tl_iter(struct timeline *tl, size_t n, time_t min, time_t max)
+{
+	struct ivl_cur c;
+
+	memset(&c, 0, sizeof(c));
+	c.tl = tl;
+	c.n = n;
+	c.a = min;
+	c.max = max;
+	c.i = tl_find(tl, n, min);
+	c.b = c.i < n && tl->v[c.i].ts < max ? tl->v[c.i].ts : max;
+	tl_load(&c);
+	return c;
+}
+
+static inline int
+tl_next(time_t *min, time_t *max, unsigned *count, unsigned *who,
+		struct ivl_cur *c)
+{
+	struct timeline *tl = c->tl;
+	struct tl_point *pt;
+
+	for (;;) {
+		if (c->w) {
+			pt = &tl->v[c->i - 1];
+			*who = (pt->lo + c->k) * 64 + __builtin_ctzll(c->w);
+			*min = c->a;
+			*max = c->b;
+			*count = pt->count;
+			c->w &= c->w - 1;
+			return 1;
+		}
+
+		if (c->i && c->k + 1 < tl->v[c->i - 1].n) {
+			pt = &tl->v[c->i - 1];
+			c->w = tl->pool[pt->off + ++c->k];
+			continue;
+		}
+
+		if (c->b >= c->max)
+			return 0;
+
+		/* next segment (if there are many points at its start, the
+		 * last one is the one that counts) */
+		c->a = c->b;
+		for (c->i++; c->i < c->n && tl->v[c->i].ts == c->a; c->i++);
+		c->b = c->i < c->n && tl->v[c->i].ts < c->max
+			? tl->v[c->i].ts : c->max;
+		tl_load(c);
+	}
+}
+
+#ifndef USE_LIBIT
+static int
+time_cmp(const void *a, const void *b)
+{
+	time_t x = *(const time_t *) a, y = *(const time_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Ask the tree. For a moment (min and max the same), we get the intervals
+ * that started at or before it and end after it. For a period, we find the
+ * ones that overlap it, and the segments are between the times where any of
+ * them starts or ends (or min and max). A segment has the intervals that
+ * cover the whole of it. */
+static struct ivl_cur
+ivt_iter(struct ivlog *log, time_t min, time_t max)
+{
+	time_t lo = min < max ? min : max, hi = min < max ? max : min;
+	struct ivl_cur c;
+	size_t i;
+
+	memset(&c, 0, sizeof(c));
+	c.use_it = 1;
+	c.log = log;
+
+	if (min == max) {
+		if (log->leaves)
+			ivt_find(log, &c.r, 1, 0, log->leaves,
+					ivl_count(log, min), min);
+		c.point = 1;
+		c.a = c.b = min;
+		c.count = c.r.n;
+		return c;
+	}
+
+	if (log->leaves)
+		ivt_find(log, &c.r, 1, 0, log->leaves, ivl_count(log, hi - 1),
+				lo);
+
+	c.pt = malloc((c.r.n * 2 + 2) * sizeof(time_t));
+	CBUG(!c.pt);
+	c.pt[c.pt_n++] = lo;
+	c.pt[c.pt_n++] = hi;
+
+	/* (like libit, a billing period that ends before it starts is a
+	 * single segment) */
+	for (i = 0; min < max && i < c.r.n; i++) {
+		struct ivl *iv = &log->v[c.r.v[i]];
+
+		if (iv->min > lo)
+			c.pt[c.pt_n++] = iv->min;
+		if (iv->max < hi)
+			c.pt[c.pt_n++] = iv->max;
+	}
+
+	qsort(c.pt, c.pt_n, sizeof(time_t), time_cmp);
+	c.r_i = c.r.n; // so that the first segment is set up
+	return c;
+}
+
+static int
+ivt_next(time_t *min, time_t *max, unsigned *count, unsigned *who,
+		struct ivl_cur *c)
+{
+	struct ivl *iv;
+	size_t i;
+
+	for (;;) {
+		for (; c->r_i < c->r.n; c->r_i++) {
+			iv = &c->log->v[c->r.v[c->r_i]];
+			if (!c->point && (iv->min > c->a || iv->max < c->b))
+				continue;
+			*min = c->a;
+			*max = c->b;
+			*count = c->count;
+			*who = iv->id;
+			c->r_i++;
+			return 1;
+		}
+
+		/* next segment (skipping the same time twice) */
+		while (c->pt_i + 1 < c->pt_n && c->pt[c->pt_i + 1] == c->pt[c->pt_i])
+			c->pt_i++;
+
+		if (c->pt_i + 1 >= c->pt_n) {
+			free(c->r.v);
+			free(c->pt);
+			c->r.v = NULL;
+			c->pt = NULL;
+			c->r.n = c->pt_n = 0;
+			return 0;
+		}
+
+		c->a = c->pt[c->pt_i++];
+		c->b = c->pt[c->pt_i];
+		c->count = 0;
+		for (i = 0; i < c->r.n; i++) {
+			iv = &c->log->v[c->r.v[i]];
+			if (iv->min <= c->a && iv->max >= c->b)
+				c->count++;
+		}
+		c->r_i = 0;
+	}
+}
+#endif
+
+
+struct tl_ev {
+	time_t ts;
+	size_t key; // index of the interval * 2, + 1 if it's its end
+};
+
+static int
+tl_ev_cmp(const void *a, const void *b)
+{
+	const struct tl_ev *x = a, *y = b;
+
+	if (x->ts != y->ts)
+		return x->ts < y->ts ? -1 : 1;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* make the timeline again, from the intervals in the log (after loading
+ * them from a checkpoint, they are not in date order) */
+static void
+tl_rebuild(struct ivlog *log)
+{
+	struct timeline *tl = &log->tl;
+	struct tl_ev *evs = malloc((log->n * 2 + 1) * sizeof(struct tl_ev));
+	size_t i, n = 0;
+
+	CBUG(!evs);
+	free(tl->v);
+	free(tl->pool);
+	free(tl->cur.w);
+	memset(tl, 0, sizeof(*tl));
+
+	for (i = 0; i < log->n; i++) {
+		evs[n].ts = log->v[i].min;
+		evs[n++].key = i * 2;
+		if (log->v[i].max == TS_OPEN)
+			continue;
+		evs[n].ts = log->v[i].max;
+		evs[n++].key = i * 2 + 1;
+	}
+
+	qsort(evs, n, sizeof(struct tl_ev), tl_ev_cmp);
+
+	for (i = 0; i < n; i++)
+		if (evs[i].key & 1)
+			tl_stop(tl, evs[i].ts, log->v[evs[i].key / 2].id);
+		else
+			tl_start(tl, evs[i].ts, log->v[evs[i].key / 2].id);
+
+	free(evs);
+}
+
+static inline void
+ivl_free(struct ivlog *log)
+{
+	free(log->v);
+	free(log->ends);
+	free(log->last);
+	free(log->tl.v);
+	free(log->tl.pool);
+	free(log->tl.cur.w);
+	memset(log, 0, sizeof(*log));
+}
+
+#endif
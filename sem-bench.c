@@ -0,0 +1,371 @@
+/* sem-bench measures how fast sem is. It makes up ledgers with sem-gen, for
+ * every combination of a number of people ("-p"), a number of lines ("-n")
+ * and an overlap of billing periods ("-O"), and runs sem on each of them
+ * in each of the modes given with "-m":
+ *
+ * q: just processing ("sem -q")
+ * s: showing the debt (plain "sem")
+ * p: showing who's present ("sem -p")
+ * d: with debug messages ("sem -d")
+ *
+ * Each run is repeated "-r" times, and we keep the fastest. For it, we write
+ * a line to the results file ("-o"), separated by tabs:
+ *
+ * people lines overlap mode wall lines/s rss read proc save out
+ *
+ * Where wall is how long sem took (in seconds), rss is the most memory it
+ * used at once (in KiB), and the last four are how long each of its phases
+ * took (see "sem -P").
+ *
+ * If a baseline file ("-b", a results file from before) is given, each run is
+ * compared with the one with the same parameters in it, and if it is slower
+ * or uses more memory by more than "-t" percent, we say so. In that case we
+ * exit with a failure, so that "make bench" fails as well.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define LIST_MAX 16
+
+struct result {
+	unsigned long people, lines, overlap;
+	char mode;
+	double wall, lps;
+	long rss;
+	double phase[4];
+};
+
+char *sem = "./sem", *gen = "./sem-gen";
+
+static inline double
+clock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* parse a comma separated list of numbers */
+static size_t
+list_get(unsigned long *v, char *s)
+{
+	size_t n = 0;
+
+	for (; n < LIST_MAX && *s; n++) {
+		v[n] = strtoul(s, &s, 10);
+		if (*s == ',')
+			s++;
+	}
+
+	return n;
+}
+
+/* make up a ledger with sem-gen, and write it to path */
+static void
+ledger_gen(char *path, unsigned long people, unsigned long lines,
+		unsigned long overlap)
+{
+	char p[24], n[24], o[24];
+	int status, fd;
+	pid_t pid;
+
+	snprintf(p, sizeof(p), "%lu", people);
+	snprintf(n, sizeof(n), "%lu", lines);
+	snprintf(o, sizeof(o), "%lu", overlap);
+
+	pid = fork();
+	if (!pid) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || dup2(fd, 1) < 0) {
+			perror(path);
+			_exit(EXIT_FAILURE);
+		}
+		execl(gen, gen, "-p", p, "-n", n, "-o", o, NULL);
+		perror(gen);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+			|| WEXITSTATUS(status)) {
+		fprintf(stderr, "sem-bench: %s failed\n", gen);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* run sem on a ledger once, and fill in the measurements of r */
+static void
+sem_run(struct result *r, char *path)
+{
+	char mode_opt[] = "-?", *line = NULL, name[8];
+	struct rusage ru;
+	size_t linesize = 0;
+	double t, start;
+	int status, fds[2], fd;
+	pid_t pid;
+	FILE *fp;
+
+	mode_opt[1] = r->mode;
+	if (pipe(fds)) {
+		perror("sem-bench");
+		exit(EXIT_FAILURE);
+	}
+
+	start = clock_now();
+	pid = fork();
+	if (!pid) {
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || dup2(fd, 0) < 0) {
+			perror(path);
+			_exit(EXIT_FAILURE);
+		}
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 1);
+		dup2(fds[1], 2);
+		close(fds[0]);
+		close(fds[1]);
+		if (r->mode == 's')
+			execl(sem, sem, "-P", NULL);
+		else
+			execl(sem, sem, "-P", mode_opt, NULL);
+		perror(sem);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (pid < 0) {
+		perror("sem-bench");
+		exit(EXIT_FAILURE);
+	}
+
+	/* read what sem writes to stderr as it goes (it can be a lot with
+	 * "-d"), keeping only the phase timings */
+	close(fds[1]);
+	fp = fdopen(fds[0], "r");
+	memset(r->phase, 0, sizeof(r->phase));
+	while (getline(&line, &linesize, fp) >= 0) {
+		if (strncmp(line, "phase ", 6)
+				|| sscanf(line + 6, "%7s %lf", name, &t) != 2)
+			continue;
+		if (!strcmp(name, "read"))
+			r->phase[0] = t;
+		else if (!strcmp(name, "proc"))
+			r->phase[1] = t;
+		else if (!strcmp(name, "save"))
+			r->phase[2] = t;
+		else if (!strcmp(name, "out"))
+			r->phase[3] = t;
+	}
+	fclose(fp);
+	free(line);
+
+	if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status)
+			|| WEXITSTATUS(status)) {
+		fprintf(stderr, "sem-bench: %s -%c < %s failed\n", sem,
+				r->mode, path);
+		exit(EXIT_FAILURE);
+	}
+
+	r->wall = clock_now() - start;
+	r->lps = r->wall > 0 ? r->lines / r->wall : 0;
+	r->rss = ru.ru_maxrss;
+}
+
+static void
+result_put(FILE *fp, struct result *r)
+{
+	fprintf(fp, "%lu\t%lu\t%lu\t%c\t%.6f\t%.0f\t%ld\t%.6f\t%.6f\t%.6f\t%.6f\n",
+			r->people, r->lines, r->overlap, r->mode, r->wall,
+			r->lps, r->rss, r->phase[0], r->phase[1], r->phase[2],
+			r->phase[3]);
+}
+
+/* read a results file. Returns how many results there are */
+static size_t
+results_get(struct result **rs, char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char *line = NULL;
+	size_t linesize = 0, n = 0, cap = 0;
+	struct result r;
+
+	*rs = NULL;
+	if (!fp) {
+		fprintf(stderr, "sem-bench: no baseline in %s, nothing to "
+				"compare with\n", path);
+		return 0;
+	}
+
+	while (getline(&line, &linesize, fp) >= 0) {
+		if (sscanf(line, "%lu %lu %lu %c %lf %lf %ld %lf %lf %lf %lf",
+					&r.people, &r.lines, &r.overlap,
+					&r.mode, &r.wall, &r.lps, &r.rss,
+					&r.phase[0], &r.phase[1], &r.phase[2],
+					&r.phase[3]) != 11)
+			continue;
+		if (n >= cap) {
+			cap = cap ? cap * 2 : 64;
+			*rs = realloc(*rs, cap * sizeof(struct result));
+		}
+		(*rs)[n++] = r;
+	}
+
+	fclose(fp);
+	free(line);
+	return n;
+}
+
+/* compare with the baseline. Returns 1 if it got worse */
+static int
+result_cmp(struct result *r, struct result *base, size_t base_n,
+		double threshold)
+{
+	struct result *b = NULL;
+	int ret = 0;
+	size_t i;
+
+	for (i = 0; i < base_n; i++)
+		if (base[i].people == r->people && base[i].lines == r->lines
+				&& base[i].overlap == r->overlap
+				&& base[i].mode == r->mode) {
+			b = &base[i];
+			break;
+		}
+
+	if (!b)
+		return 0;
+
+	if (r->wall > b->wall * (1 + threshold)) {
+		fprintf(stderr, "REGRESSION -p %lu -n %lu -O %lu -%c: "
+				"%.3fs, was %.3fs (%+.1f%%)\n", r->people,
+				r->lines, r->overlap, r->mode, r->wall,
+				b->wall, (r->wall / b->wall - 1) * 100);
+		ret = 1;
+	}
+
+	/* a few pages more or less are just noise */
+	if (r->rss > b->rss * (1 + threshold) && r->rss - b->rss > 1024) {
+		fprintf(stderr, "REGRESSION -p %lu -n %lu -O %lu -%c: "
+				"%ldKiB, was %ldKiB (%+.1f%%)\n", r->people,
+				r->lines, r->overlap, r->mode, r->rss, b->rss,
+				((double) r->rss / b->rss - 1) * 100);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+static inline void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s sem] [-g sem-gen] [-o results]"
+			" [-b baseline] [-t percent] [-r repeats]"
+			" [-p people,...] [-n lines,...] [-O overlap,...]"
+			" [-m modes]\n", prog);
+	fprintf(stderr, "    Options:\n");
+	fprintf(stderr, "        -s path   sem to run (./sem).\n");
+	fprintf(stderr, "        -g path   sem-gen to run (./sem-gen).\n");
+	fprintf(stderr, "        -o file   where to write the results "
+			"(stdout).\n");
+	fprintf(stderr, "        -b file   results to compare with.\n");
+	fprintf(stderr, "        -t n      percent that counts as worse "
+			"(10).\n");
+	fprintf(stderr, "        -r n      runs of each, keeping the fastest "
+			"(3).\n");
+	fprintf(stderr, "        -p list   numbers of people (6,60).\n");
+	fprintf(stderr, "        -n list   numbers of lines "
+			"(10000,100000).\n");
+	fprintf(stderr, "        -O list   overlaps of billing periods, in "
+			"days (0,10).\n");
+	fprintf(stderr, "        -m modes  some of q, s, p and d (qspd).\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long people[LIST_MAX] = { 6, 60 },
+		 lines[LIST_MAX] = { 10000, 100000 },
+		 overlap[LIST_MAX] = { 0, 10 }, repeats = 3;
+	size_t people_n = 2, lines_n = 2, overlap_n = 2, base_n = 0, a, b, c;
+	char *modes = "qspd", *m, *out_path = NULL, *base_path = NULL;
+	char path[] = "/tmp/sem-bench.XXXXXX";
+	struct result *base = NULL, r, best;
+	double threshold = 0.1;
+	int ch, fd, worse = 0;
+	FILE *out = stdout;
+
+	while ((ch = getopt(argc, argv, "s:g:o:b:t:r:p:n:O:m:")) != -1) {
+		switch (ch) {
+		case 's': sem = optarg; break;
+		case 'g': gen = optarg; break;
+		case 'o': out_path = optarg; break;
+		case 'b': base_path = optarg; break;
+		case 't': threshold = strtod(optarg, NULL) / 100; break;
+		case 'r': repeats = strtoul(optarg, NULL, 10); break;
+		case 'p': people_n = list_get(people, optarg); break;
+		case 'n': lines_n = list_get(lines, optarg); break;
+		case 'O': overlap_n = list_get(overlap, optarg); break;
+		case 'm': modes = optarg; break;
+		default:
+			usage(*argv);
+			return 1;
+		}
+	}
+
+	if (!repeats)
+		repeats = 1;
+
+	if (base_path)
+		base_n = results_get(&base, base_path);
+
+	if (out_path && !(out = fopen(out_path, "w"))) {
+		perror(out_path);
+		return EXIT_FAILURE;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	for (a = 0; a < people_n; a++)
+	for (b = 0; b < lines_n; b++)
+	for (c = 0; c < overlap_n; c++) {
+		ledger_gen(path, people[a], lines[b], overlap[c]);
+
+		for (m = modes; *m; m++) {
+			r.people = people[a];
+			r.lines = lines[b];
+			r.overlap = overlap[c];
+			r.mode = *m;
+
+			sem_run(&r, path);
+			best = r;
+			for (unsigned long i = 1; i < repeats; i++) {
+				sem_run(&r, path);
+				if (r.wall < best.wall)
+					best = r;
+			}
+
+			result_put(out, &best);
+			fflush(out);
+			worse |= result_cmp(&best, base, base_n, threshold);
+		}
+	}
+
+	unlink(path);
+	free(base);
+	if (out != stdout)
+		fclose(out);
+
+	return worse ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+/* sem-compile reads a ledger in the text format (see README.md) from standard
+ * input, and writes it to standard output in a compact binary format, that
+ * sem can read with "-b" without having to parse any text.
+ *
+ * The file starts with a header (struct bin_hdr): a magic string, the version
+ * of the format, and the maximum number of events in a block. Then comes the
+ * dictionary of nicknames: how many there are (u32), and for each of them,
+ * its length (u8) and its characters, followed by a hash of the dictionary
+ * (u64, see hash64). Events refer to nicknames by their position in it.
+ *
+ * After that come the blocks of events. Each starts with the number of events
+ * in it (u32) and the size of what follows (u32). Then there is one column per
+ * field (enum bin_col), each preceded by its size (u32), and finally a hash of
+ * the columns (u64). A block with no events marks the end of the file.
+ *
+ * The columns have, for each event (in order):
+ *
+ * op: the TYPE of line, one byte (enum op_kind)
+ * line: the line number, minus the previous one
+ * ts: the DATE, minus the previous one
+ * who: the first PERSON_ID
+ * who2: the second PERSON_ID (TRANSFER only)
+ * value: the AMOUNT in cents (TRANSFER, PAY and BUY only)
+ * min: START_DATE minus DATE (PAY only)
+ * max: END_DATE minus START_DATE (PAY only)
+ *
+ * Integers in the columns are varints (see varint_put), and the ones that can
+ * be negative are zigzag encoded first. Differences start from 0 in each
+ * block, so that every block can be read on its own. Header integers are in
+ * host byte order.
+ */
+
+#define _DEFAULT_SOURCE
+#include "common.h"
+
+/* encode n events as a block, and append it to out */
+static void
+block_put(struct wbuf *out, struct ev *ev, size_t n)
+{
+	struct wbuf col[BC_MAX_COL];
+	unsigned char op;
+	unsigned line = 0;
+	time_t ts = 0;
+	uint32_t u;
+	uint64_t h;
+	size_t at, i;
+
+	memset(col, 0, sizeof(col));
+
+	for (i = 0; i < n; i++, ev++) {
+		op = ev->op;
+		wb_put(&col[BC_OP], &op, 1);
+		varint_put(&col[BC_LINE], ev->line - line);
+		varint_put(&col[BC_TS], zigzag(ev->ts - ts));
+		varint_put(&col[BC_WHO], ev->who);
+		line = ev->line;
+		ts = ev->ts;
+
+		switch (ev->op) {
+		case OP_TRANSFER:
+			varint_put(&col[BC_WHO2], ev->who2);
+			varint_put(&col[BC_VALUE], zigzag(ev->value));
+			break;
+		case OP_PAY:
+			varint_put(&col[BC_VALUE], zigzag(ev->value));
+			varint_put(&col[BC_MIN], zigzag(ev->min - ev->ts));
+			varint_put(&col[BC_MAX], zigzag(ev->max - ev->min));
+			break;
+		case OP_BUY:
+			varint_put(&col[BC_VALUE], zigzag(ev->value));
+			break;
+		}
+	}
+
+	u = n;
+	wb_put(out, &u, sizeof(u));
+	for (u = 0, i = 0; i < BC_MAX_COL; i++)
+		u += sizeof(u) + col[i].n;
+	wb_put(out, &u, sizeof(u));
+
+	at = out->n;
+	for (i = 0; i < BC_MAX_COL; i++) {
+		u = col[i].n;
+		wb_put(out, &u, sizeof(u));
+		wb_put(out, col[i].p, col[i].n);
+		free(col[i].p);
+	}
+
+	h = hash64(out->p + at, out->n - at, 0);
+	wb_put(out, &h, sizeof(h));
+}
+
+int
+main(void)
+{
+	struct wbuf blocks = { NULL, 0, 0 }, head = { NULL, 0, 0 };
+	struct names nm;
+	struct bin_hdr hdr;
+	struct ev *ev;
+	char *buf, *line, *nl, *end;
+	unsigned line_n = 0;
+	size_t len, n = 0;
+	uint32_t u;
+	uint64_t h;
+	uint8_t nlen;
+	int ret;
+
+	memset(&nm, 0, sizeof(nm));
+	buf = slurp(stdin, &len);
+	end = buf + len;
+	ev = malloc(BIN_BLOCK * sizeof(struct ev));
+	CBUG(!ev);
+
+	for (line = buf; line < end; line = nl) {
+		nl = memchr(line, '\n', end - line);
+		nl = nl ? nl + 1 : end;
+		line_n++;
+
+		ret = ev_parse(&ev[n], &nm, line, nl);
+		ev[n].line = line_n;
+		if (!ret)
+			continue;
+		if (ret < 0)
+			ev_fail(&ev[n]);
+
+		if (++n == BIN_BLOCK) {
+			block_put(&blocks, ev, n);
+			n = 0;
+		}
+	}
+
+	if (n)
+		block_put(&blocks, ev, n);
+
+	/* end of the blocks */
+	u = 0;
+	wb_put(&blocks, &u, sizeof(u));
+	wb_put(&blocks, &u, sizeof(u));
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BIN_MAGIC, sizeof(BIN_MAGIC));
+	hdr.version = BIN_VERSION;
+	hdr.block = BIN_BLOCK;
+	wb_put(&head, &hdr, sizeof(hdr));
+
+	u = nm.n;
+	wb_put(&head, &u, sizeof(u));
+	for (u = 0; u < nm.n; u++) {
+		nlen = strlen(names_str(&nm, u));
+		wb_put(&head, &nlen, sizeof(nlen));
+		wb_put(&head, names_str(&nm, u), nlen);
+	}
+	h = hash64(head.p + sizeof(hdr), head.n - sizeof(hdr), 0);
+	wb_put(&head, &h, sizeof(h));
+
+	if (fwrite(head.p, 1, head.n, stdout) != head.n
+			|| fwrite(blocks.p, 1, blocks.n, stdout) != blocks.n
+			|| fflush(stdout)) {
+		perror("sem-compile");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -5,20 +5,27 @@
 char *insert;
 time_t insert_ts;
 int finished = 0;
+unsigned line_n = 0;
 
 static inline void
-process_line(char *line)
+process_line(char *line, size_t len)
 {
-	char op_type_str[9];
+	char *op, *end = line + len;
+	size_t op_len;
 	time_t ts;
+	int err;
 
+	line_n++;
 	if (finished || line[0] == '#' || line[0] == '\n') {
 		printf("%s", line);
 		return;
 	}
 
-	read_word(op_type_str, &line, sizeof(op_type_str));
-	ts = read_ts(&line);
+	op = read_tok(&line, end, &op_len);
+	if ((err = read_ts(&line, end, &ts))) {
+		fprintf(stderr, "line %u: %s\n", line_n, parse_errs[err]);
+		exit(EXIT_FAILURE);
+	}
 
 	char tss[DATE_MAX_LEN];
 	printtime(tss, ts);
@@ -28,7 +35,7 @@ process_line(char *line)
 		finished = 1;
 	}
 
-	printf("%s %s%s", op_type_str, tss, line);
+	printf("%.*s %s%s", (int) op_len, op, tss, line);
 }
 
 int
@@ -38,15 +45,20 @@ main(int argc, char *argv[])
 	char *line = NULL;
 	ssize_t linelen;
 	size_t linesize;
+	int err;
 
 	insert = argv[1];
 
 	insert_tss = strchr(insert, ' ');
 	CBUG(!insert_tss);
-	insert_ts = read_ts(&insert_tss);
+	if ((err = read_ts(&insert_tss, insert_tss + strlen(insert_tss),
+					&insert_ts))) {
+		fprintf(stderr, "%s: %s\n", insert, parse_errs[err]);
+		return EXIT_FAILURE;
+	}
 
 	while ((linelen = getline(&line, &linesize, stdin)) >= 0)
-		process_line(line);
+		process_line(line, linelen);
 
 	if (!finished)
 		printf("%s\n", insert);
@@ -0,0 +1,302 @@
+/* sem-gen writes a made up (but valid) data file to standard output, so that
+ * sem can be tried on inputs of any size. The same options and seed always
+ * give the same file.
+ *
+ * It starts with "-p" people renting rooms, and from then on each line is
+ * the next thing that happens, a random amount of time after the previous
+ * one (on average "-i" seconds), so lines are always in date order:
+ *
+ * Bills ("-b" kinds of them) are paid a few days after their billing period
+ * ends, and each period starts "-o" days before the previous one ended, so
+ * periods overlap. The rest is random, with these weights (per 1000 lines):
+ *
+ * -c: someone leaves (STOP) or someone arrives (START), keeping about "-p"
+ *     people renting. Some of the ones who arrive are people who had left,
+ *     and "-N" in 1000 of those are someone new with the same nickname
+ *     (START with "name~").
+ * -r: someone goes away for a while (PAUSE) or comes back (RESUME).
+ * -B: someone buys something for the house (BUY).
+ * -t: someone pays someone back (TRANSFER).
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DAY 86400
+
+enum state {
+	GONE,
+	PRESENT,
+	PAUSED,
+	STATE_MAX,
+};
+
+struct person {
+	char name[16];
+	enum state state;
+	size_t pos; // in its set
+};
+
+/* people in the same state, so that we can pick one of them at random */
+struct set {
+	size_t *v, n, cap;
+};
+
+struct bill {
+	time_t min, max, due;
+	long avg; // cents
+};
+
+struct person *people;
+size_t people_n, people_cap;
+struct set sets[STATE_MAX];
+uint64_t rng = 1;
+unsigned long renamed; // "-N", per 1000 who come back
+
+/* xorshift64*, so that output doesn't depend on the libc */
+static inline uint64_t
+rnd(uint64_t n)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return n ? (rng * 0x2545f4914f6cdd1dULL) % n : 0;
+}
+
+static void
+set_add(size_t i, enum state state)
+{
+	struct set *s = &sets[state];
+
+	if (s->n >= s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 64;
+		s->v = realloc(s->v, s->cap * sizeof(size_t));
+	}
+
+	people[i].state = state;
+	people[i].pos = s->n;
+	s->v[s->n++] = i;
+}
+
+static void
+set_move(size_t i, enum state state)
+{
+	struct person *p = &people[i];
+	struct set *s = &sets[p->state];
+
+	/* take it out of its current set (putting the last one in its place) */
+	s->v[p->pos] = s->v[--s->n];
+	people[s->v[p->pos]].pos = p->pos;
+
+	set_add(i, state);
+}
+
+static inline size_t
+set_pick(enum state state)
+{
+	return sets[state].v[rnd(sets[state].n)];
+}
+
+static void
+print_ts(time_t ts, int date_only)
+{
+	char buf[32];
+	struct tm tm;
+
+	gmtime_r(&ts, &tm);
+	strftime(buf, sizeof(buf), date_only ? "%Y-%m-%d" : "%Y-%m-%dT%H:%M:%S",
+			&tm);
+	fputs(buf, stdout);
+}
+
+static inline void
+print_cents(long value)
+{
+	printf(" %ld.%02ld", value / 100, value % 100);
+}
+
+/* someone new, or someone who had left, starts renting */
+static void
+gen_start(time_t ts)
+{
+	size_t i;
+	int fresh = 0;
+
+	if (sets[GONE].n && !rnd(3)) {
+		i = set_pick(GONE);
+		/* (only asking when there's "-N", so that files without it
+		 * stay the same) */
+		fresh = renamed && rnd(1000) < renamed;
+	} else {
+		if (people_n >= people_cap) {
+			people_cap = people_cap ? people_cap * 2 : 64;
+			people = realloc(people, people_cap * sizeof(struct person));
+		}
+		i = people_n++;
+		snprintf(people[i].name, sizeof(people[i].name), "p%zu", i);
+		set_add(i, GONE);
+	}
+
+	set_move(i, PRESENT);
+	printf("START ");
+	print_ts(ts, 0);
+	printf(" %s%s\n", people[i].name, fresh ? "~" : "");
+}
+
+static void
+gen_line(char *op, time_t ts, size_t i, enum state state)
+{
+	set_move(i, state);
+	printf("%s ", op);
+	print_ts(ts, 0);
+	printf(" %s\n", people[i].name);
+}
+
+static inline void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s seed] [-n lines] [-p people] [-i secs]"
+			" [-b bills] [-o days] [-c n] [-N n] [-r n] [-B n]"
+			" [-t n]\n",
+			prog);
+	fprintf(stderr, "    Options:\n");
+	fprintf(stderr, "        -s seed   random seed (1).\n");
+	fprintf(stderr, "        -n lines  how many lines (10000).\n");
+	fprintf(stderr, "        -p n      people renting at a time (6).\n");
+	fprintf(stderr, "        -i secs   average time between lines "
+			"(21600).\n");
+	fprintf(stderr, "        -b n      kinds of recurring bills (4).\n");
+	fprintf(stderr, "        -o days   overlap of billing periods (3).\n");
+	fprintf(stderr, "        -c n      STOP/START per 1000 lines (10).\n");
+	fprintf(stderr, "        -N n      of 1000 who come back, how many are "
+			"someone new (0).\n");
+	fprintf(stderr, "        -r n      PAUSE/RESUME per 1000 lines (20).\n");
+	fprintf(stderr, "        -B n      BUY per 1000 lines (500).\n");
+	fprintf(stderr, "        -t n      TRANSFER per 1000 lines (100).\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long lines = 10000, want = 6, step = 21600, bills_n = 4,
+		 overlap = 3, churn = 10, pauses = 20, buys = 500,
+		 transfers = 100, n, r, total;
+	struct bill *bills;
+	time_t ts = 1577836800; // 2020-01-01
+	size_t i, j;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:n:p:i:b:o:c:N:r:B:t:")) != -1) {
+		unsigned long v = strtoul(optarg ? optarg : "0", NULL, 10);
+
+		switch (c) {
+		case 's': rng = v ? v : 1; break;
+		case 'n': lines = v; break;
+		case 'p': want = v ? v : 1; break;
+		case 'i': step = v; break;
+		case 'b': bills_n = v; break;
+		case 'o': overlap = v; break;
+		case 'c': churn = v; break;
+		case 'N': renamed = v; break;
+		case 'r': pauses = v; break;
+		case 'B': buys = v; break;
+		case 't': transfers = v; break;
+		default:
+			usage(*argv);
+			return 1;
+		}
+	}
+
+	total = churn + pauses + buys + transfers;
+	if (!total) {
+		buys = 1;
+		total = 1;
+	}
+
+	for (n = 0; n < lines && n < want; n++)
+		gen_start(ts += rnd(step));
+
+	/* first billing periods start on one of the following days */
+	bills = calloc(bills_n + 1, sizeof(struct bill));
+	for (i = 0; i < bills_n; i++) {
+		time_t len = (28 + i % 4) * DAY;
+		bills[i].min = ts - ts % DAY + (1 + rnd(len / DAY)) * DAY;
+		bills[i].max = bills[i].min + len;
+		bills[i].due = bills[i].max + (1 + rnd(10)) * DAY;
+		bills[i].avg = 2000 + rnd(20000);
+	}
+
+	for (; n < lines; n++) {
+		ts += rnd(2 * step + 1);
+
+		/* bills that are due come first */
+		for (i = 0; i < bills_n && ts < bills[i].due; i++);
+		if (i < bills_n) {
+			struct bill *b = &bills[i];
+			time_t len = b->max - b->min;
+
+			if (sets[PRESENT].n || sets[PAUSED].n) {
+				j = sets[PRESENT].n ? set_pick(PRESENT)
+					: set_pick(PAUSED);
+				printf("PAY ");
+				print_ts(ts, 0);
+				printf(" %s", people[j].name);
+				print_cents(b->avg / 2 + rnd(b->avg));
+				putchar(' ');
+				print_ts(b->min, 1);
+				putchar(' ');
+				print_ts(b->max, 1);
+				printf(" # bill%zu\n", i);
+			} else
+				n--;
+
+			b->min = b->max - (time_t) overlap * DAY;
+			b->max = b->min + len;
+			b->due = b->max + (1 + rnd(10)) * DAY;
+			if (b->due < ts)
+				b->due = ts;
+			continue;
+		}
+
+		r = rnd(total);
+
+		if (r < churn || !sets[PRESENT].n) {
+			if (sets[PRESENT].n + sets[PAUSED].n < want
+					|| sets[PRESENT].n < 2)
+				gen_start(ts);
+			else
+				gen_line("STOP", ts, set_pick(PRESENT), GONE);
+		} else if ((r -= churn) < pauses) {
+			if (sets[PAUSED].n && (rnd(2) || sets[PRESENT].n < 2))
+				gen_line("RESUME", ts, set_pick(PAUSED), PRESENT);
+			else if (sets[PRESENT].n >= 2)
+				gen_line("PAUSE", ts, set_pick(PRESENT), PAUSED);
+			else
+				gen_start(ts);
+		} else if ((r -= pauses) < buys) {
+			printf("BUY ");
+			print_ts(ts, 0);
+			printf(" %s", people[set_pick(PRESENT)].name);
+			print_cents(100 + rnd(5000));
+			printf(rnd(4) ? "\n" : " # groceries\n");
+		} else {
+			i = set_pick(PRESENT);
+			j = set_pick(rnd(2) || !sets[PAUSED].n ? PRESENT : PAUSED);
+			if (i == j) {
+				n--;
+				continue;
+			}
+			printf("TRANSFER ");
+			print_ts(ts, 0);
+			printf(" %s %s", people[i].name, people[j].name);
+			print_cents(100 + rnd(20000));
+			putchar('\n');
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
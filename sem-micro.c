@@ -0,0 +1,425 @@
+/* sem-micro measures, one at a time, the small pieces that sem spends most of
+ * its time in, so that when sem-bench says sem got slower, we can find out
+ * which of them is to blame. For each one, it says how many nanoseconds a
+ * single call takes on average (ns/op):
+ *
+ * read_tok: finding where the next word is (without copying it).
+ * read_ts: reading a date (see ts_parse).
+ * read_currency: reading an amount.
+ * op_kind: finding out the TYPE of a line from its first word.
+ * names_get: finding the number of a nickname (for "-p" people).
+ * ge_add, ge_get: adding to and reading the debt between two of "-p" people.
+ * ivl_start+stop: adding an interval to an interval log (see ivl.h) that
+ *                 has "-i" of them.
+ * tl_iter pay: going through who was there in a billing period, with the
+ *              timeline (a call here is all of what op_pay does with it).
+ * tl_iter buy: the same, for the point in time of a BUY.
+ * ivt_iter pay, ivt_iter buy: the same, asking the tree instead (as sem does
+ *                             when lines are not in date order).
+ *
+ * Each is run over and over, for at least "-t" milliseconds.
+ */
+
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "common.h"
+#include "ge.h"
+#include "ivl.h"
+
+#define LIST_MAX 16
+#define TOK_N 4096 // tokens in the input we read from
+#define PAIR_N 65536 // pairs of people for ge_add / ge_get
+#define QUERY_N 4096 // queries to the BSTs
+
+typedef void (bench_t)(size_t n);
+
+double min_time = 0.2;
+volatile uint64_t sink; // so that the compiler doesn't skip the work
+
+char *tok_buf, *tok_end;
+unsigned *pairs;
+struct names nm;
+struct ge bge;
+struct ivlog ilog;
+time_t queries[QUERY_N][2];
+
+/* call f with larger and larger n until it takes long enough. Returns
+ * nanoseconds per call */
+static double
+bench_run(bench_t *f)
+{
+	double t = 0, start;
+	size_t n;
+
+	for (n = 1; ; n *= 2) {
+		start = clock_now();
+		f(n);
+		t = clock_now() - start;
+		if (t >= min_time)
+			break;
+	}
+
+	return t * 1e9 / n;
+}
+
+static void
+bench_show(char *name, char *param, double ns)
+{
+	printf("%-16s %-16s %10.1f ns/op\n", name, param, ns);
+	fflush(stdout);
+}
+
+/* TOK_N words like the ones fmt makes (given a random number from base to
+ * base + mod - 1, one from 1 to 28 and one from 0 to 23), separated by
+ * spaces */
+static void
+tok_fill(char *fmt, unsigned base, unsigned mod)
+{
+	struct wbuf wb = { NULL, 0, 0 };
+	char word[64];
+	unsigned i, x = 12345;
+
+	for (i = 0; i < TOK_N; i++) {
+		x = x * 1103515245 + 12345;
+		snprintf(word, sizeof(word), fmt, base + x % mod,
+				1 + x / 7 % 28, x / 11 % 24);
+		wb_put(&wb, word, strlen(word));
+		wb_put(&wb, " ", 1);
+	}
+
+	free(tok_buf);
+	tok_buf = wb.p;
+	tok_end = wb.p + wb.n;
+}
+
+static void
+b_read_tok(size_t n)
+{
+	char *p = tok_buf;
+	size_t len;
+
+	for (; n; n--) {
+		if (p >= tok_end - 1)
+			p = tok_buf;
+		sink += *read_tok(&p, tok_end, &len) + len;
+	}
+}
+
+static void
+b_read_ts(size_t n)
+{
+	char *p = tok_buf;
+	time_t ts = 0;
+
+	for (; n; n--) {
+		if (p >= tok_end - 1)
+			p = tok_buf;
+		read_ts(&p, tok_end, &ts);
+		sink += ts;
+	}
+}
+
+static void
+b_read_currency(size_t n)
+{
+	char *p = tok_buf;
+	int64_t value = 0;
+
+	for (; n; n--) {
+		if (p >= tok_end - 1)
+			p = tok_buf;
+		read_currency(&p, tok_end, &value);
+		sink += value;
+	}
+}
+
+static void
+b_op_kind(size_t n)
+{
+	char *p = tok_buf, *tok;
+	size_t len;
+
+	for (; n; n--) {
+		if (p >= tok_end - 1)
+			p = tok_buf;
+		tok = read_tok(&p, tok_end, &len);
+		sink += op_kind(tok, len);
+	}
+}
+
+static void
+b_names_get(size_t n)
+{
+	char *p = tok_buf, *tok;
+	size_t len;
+
+	for (; n; n--) {
+		if (p >= tok_end - 1)
+			p = tok_buf;
+		tok = read_tok(&p, tok_end, &len);
+		sink += names_get(&nm, tok, len);
+	}
+}
+
+static void
+b_ge_add(size_t n)
+{
+	unsigned *pair;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		pair = &pairs[(i % PAIR_N) * 2];
+		ge_add(&bge, pair[0], pair[1], 100);
+	}
+}
+
+static void
+b_ge_get(size_t n)
+{
+	unsigned *pair;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		pair = &pairs[(i % PAIR_N) * 2];
+		sink += ge_get(&bge, pair[0], pair[1]);
+	}
+}
+
+/* random pairs of different people, out of h */
+static void
+pairs_fill(unsigned h)
+{
+	unsigned i, x = 54321;
+
+	for (i = 0; i < PAIR_N * 2; i += 2) {
+		x = x * 1103515245 + 12345;
+		pairs[i] = (x >> 8) % h;
+		x = x * 1103515245 + 12345;
+		pairs[i + 1] = (x >> 8) % (h - 1);
+		if (pairs[i + 1] >= pairs[i])
+			pairs[i + 1]++;
+	}
+}
+
+/* Fill a new interval log with n intervals of h people, who come and go,
+ * an hour apart, in a random order. Returns how long it took. Queries are
+ * also set up, for billing periods of a month, within the time the
+ * intervals cover */
+static double
+ivl_fill(unsigned h, size_t n)
+{
+	char *present = calloc(h, 1);
+	time_t ts = 0;
+	double start;
+	unsigned who, x = 777;
+	size_t i;
+
+	CBUG(!present);
+	ivl_free(&ilog);
+#ifdef USE_LIBIT
+	ilog.itd = it_init(NULL);
+#endif
+	start = clock_now();
+
+	for (i = 0; i < n; ts += 3600) {
+		x = x * 1103515245 + 12345;
+		who = (x >> 8) % h;
+		if (present[who]) {
+			ivl_stop(&ilog, ts, who);
+			i++;
+		} else
+			ivl_start(&ilog, ts, who);
+		present[who] = !present[who];
+	}
+
+	start = clock_now() - start;
+
+	for (i = 0; i < QUERY_N; i++) {
+		x = x * 1103515245 + 12345;
+		queries[i][0] = (time_t) (x >> 4) % (ts + 1);
+		queries[i][1] = queries[i][0] + 30 * 86400;
+	}
+
+	free(present);
+	return start;
+}
+
+static void
+b_tl_pay(size_t n)
+{
+	time_t min, max;
+	unsigned count, who;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct ivl_cur c = tl_iter(&ilog.tl, ilog.tl.n,
+				queries[i % QUERY_N][0],
+				queries[i % QUERY_N][1]);
+		while (tl_next(&min, &max, &count, &who, &c))
+			sink += who;
+	}
+}
+
+static void
+b_tl_buy(size_t n)
+{
+	time_t min, max;
+	unsigned count, who;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct ivl_cur c = tl_iter(&ilog.tl, ilog.tl.n,
+				queries[i % QUERY_N][0],
+				queries[i % QUERY_N][0]);
+		while (tl_next(&min, &max, &count, &who, &c))
+			sink += who;
+	}
+}
+
+#ifndef USE_LIBIT
+static void
+b_ivt_pay(size_t n)
+{
+	time_t min, max;
+	unsigned count, who;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct ivl_cur c = ivt_iter(&ilog, queries[i % QUERY_N][0],
+				queries[i % QUERY_N][1]);
+		while (ivt_next(&min, &max, &count, &who, &c))
+			sink += who;
+	}
+}
+
+static void
+b_ivt_buy(size_t n)
+{
+	time_t min, max;
+	unsigned count, who;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct ivl_cur c = ivt_iter(&ilog, queries[i % QUERY_N][0],
+				queries[i % QUERY_N][0]);
+		while (ivt_next(&min, &max, &count, &who, &c))
+			sink += who;
+	}
+}
+#endif
+
+/* parse a comma separated list of numbers */
+static size_t
+list_get(unsigned long *v, char *s)
+{
+	size_t n = 0;
+
+	for (; n < LIST_MAX && *s; n++) {
+		v[n] = strtoul(s, &s, 10);
+		if (*s == ',')
+			s++;
+	}
+
+	return n;
+}
+
+static inline void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p people,...] [-i intervals,...]"
+			" [-t ms]\n", prog);
+	fprintf(stderr, "    Options:\n");
+	fprintf(stderr, "        -p list   numbers of people "
+			"(6,60,600,6000).\n");
+	fprintf(stderr, "        -i list   numbers of intervals "
+			"(1000,100000).\n");
+	fprintf(stderr, "        -t ms     minimum time for each (200).\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long people[LIST_MAX] = { 6, 60, 600, 6000 },
+		 ivls[LIST_MAX] = { 1000, 100000 };
+	size_t people_n = 4, ivls_n = 2, i, j;
+	char param[48];
+	int c;
+
+	while ((c = getopt(argc, argv, "p:i:t:")) != -1) {
+		switch (c) {
+		case 'p': people_n = list_get(people, optarg); break;
+		case 'i': ivls_n = list_get(ivls, optarg); break;
+		case 't': min_time = strtoul(optarg, NULL, 10) / 1000.0; break;
+		default:
+			usage(*argv);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < people_n; i++)
+		if (people[i] < 2)
+			people[i] = 2;
+
+	tok_fill("p%u", 0, 60);
+	bench_show("read_tok", "-", bench_run(b_read_tok));
+
+	tok_fill("2022-%02u-%02uT%02u:40:23", 1, 12);
+	bench_show("read_ts", "-", bench_run(b_read_ts));
+
+	tok_fill("%u.%02u", 0, 1000);
+	bench_show("read_currency", "-", bench_run(b_read_currency));
+
+	{
+		struct wbuf wb = { NULL, 0, 0 };
+
+		for (i = 0; i < TOK_N; i++) {
+			char *op = op_names[i * 7919 % OP_MAX];
+			wb_put(&wb, op, strlen(op));
+			wb_put(&wb, " ", 1);
+		}
+		free(tok_buf);
+		tok_buf = wb.p;
+		tok_end = wb.p + wb.n;
+		bench_show("op_kind", "-", bench_run(b_op_kind));
+	}
+
+	pairs = malloc(PAIR_N * 2 * sizeof(unsigned));
+	CBUG(!pairs);
+
+	for (i = 0; i < people_n; i++) {
+		snprintf(param, sizeof(param), "p=%lu", people[i]);
+
+		tok_fill("p%u", 0, people[i]);
+		memset(&nm, 0, sizeof(nm));
+		bench_show("names_get", param, bench_run(b_names_get));
+		names_free(&nm);
+
+		pairs_fill(people[i]);
+		memset(&bge, 0, sizeof(bge));
+		bench_show("ge_add", param, bench_run(b_ge_add));
+		bench_show("ge_get", param, bench_run(b_ge_get));
+		ge_free(&bge);
+	}
+
+	for (i = 0; i < people_n; i++)
+		for (j = 0; j < ivls_n; j++) {
+			double t = ivl_fill(people[i], ivls[j]);
+
+			snprintf(param, sizeof(param), "p=%lu,i=%lu",
+					people[i], ivls[j]);
+
+			/* the log only grows, so this is measured once */
+			bench_show("ivl_start+stop", param, t * 1e9 / ivls[j]);
+			bench_show("tl_iter pay", param, bench_run(b_tl_pay));
+			bench_show("tl_iter buy", param, bench_run(b_tl_buy));
+#ifndef USE_LIBIT
+			bench_show("ivt_iter pay", param, bench_run(b_ivt_pay));
+			bench_show("ivt_iter buy", param, bench_run(b_ivt_buy));
+#endif
+		}
+
+	ivl_free(&ilog);
+
+	return EXIT_SUCCESS;
+}
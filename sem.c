@@ -19,7 +19,8 @@
  * Person ids are also particular in this way. In the input file they are
  * textual, but internally we use numeric ids to which they correspond.
  *
- * Currency values are read as float but internally they are integers.
+ * Currency values are written with decimals, but internally they are integer
+ * numbers of cents.
  *
  * The general idea of the algorithm involves a few data structures:
  *
@@ -32,7 +33,9 @@
  * etc. Actually, there are two of these kinds of BSTs. One That only stores
  * intervals where the person is actually in the house (BST A), another that
  * stores intervals where the person is renting a room there, but might not be
- * present (BST B).
+ * present (BST B). Alongside each BST, we also keep a "timeline" of the
+ * moments when who is there changed, which gives the same answers, but
+ * faster (see ivl_iter).
  *
  * Jump to the main function when you are ready to check out how it all works.
  *
@@ -46,6 +49,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #ifdef __OpenBSD__
 #include <sys/queue.h>
@@ -57,58 +64,85 @@
 #include <it.h>
 
 #include "common.h"
+#include "ge.h"
+#include "ivl.h"
 
 #define ndebug(fmt, ...) \
 	if (pflags & PF_DEBUG) \
 		fprintf(stderr, fmt, ##__VA_ARGS__)
 
 #define PAYER_TIP 1
-#define USERNAME_MAX_LEN 32
-#define CURRENCY_MAX_LEN 32
+#define NO_ID ((unsigned) -1)
 
 enum pflags {
 	PF_DEBUG = 1,
 	PF_PRESENT = 2,
 	PF_QUIET = 4,
+	PF_SETTLE = 8,
+	PF_SETTLE_LINES = 16,
+	PF_PHASES = 32,
+	PF_TIMING = 64,
+	PF_TWO_PHASE = 128,
+	PF_PARITY = 256,
+	PF_NET = 512,
+	PF_PREFIX = 1024,
 };
 
-typedef void (op_proc_t)(time_t ts, char *line);
+/* what the time is spent on, for "-P" */
+enum phase {
+	PH_READ, // reading the input (and the checkpoint)
+	PH_PROC, // parsing and processing lines
+	PH_SAVE, // saving the checkpoint
+	PH_OUT, // showing the results
+	PH_MAX,
+};
+
+char *phase_names[] = { "read", "proc", "save", "out" };
+
+typedef void (op_proc_t)(struct ev *ev);
 op_proc_t op_start, op_stop, op_pause, op_resume, op_transfer, op_pay, op_buy;
 
-struct op {
-	char *name;
-	op_proc_t *cb;
-} op_map[] = {
-	{ "START", op_start },
-	{ "STOP", op_stop },
-	{ "PAUSE", op_pause },
-	{ "RESUME", op_resume },
-	{ "TRANSFER", op_transfer },
-	{ "PAY", op_pay },
-	{ "BUY", op_buy },
+/* by enum op_kind */
+op_proc_t *op_map[] = {
+	op_start,
+	op_stop,
+	op_pause,
+	op_resume,
+	op_transfer,
+	op_pay,
+	op_buy,
 };
 
-unsigned op_hd, // ops
-	 g_hd, // name to id
-	 ig_hd, // id to name
-	 ge_hd, // edge (id pair / debt)
-	 gwho_hd, // id for graph
-	 gnpwho_hd, // id for graph, no pause
-
-	 p_itd, // pause / present
+#ifdef USE_LIBIT
+unsigned p_itd, // pause / present
 	 np_itd; // no pause
+#endif
+
+struct bits gwho, // ids present
+	    gnpwho; // ids renting (present or paused)
 
-struct idm idm;
+struct ge ge; // edge (id pair / debt)
+unsigned idm_n = 0; // how many ids were generated
+
+struct names names; // all nicknames seen
+unsigned *nid, nid_n = 0; // by name, its current numeric id (or NO_ID)
+unsigned *id_name, id_name_n = 0; // by id, its nickname
+unsigned line_n = 0; // how many lines were read
+unsigned jobs = 1; // how many threads parse the input (and work out bills)
 
 unsigned pflags = 0;
+double phase_t[PH_MAX], phase_last;
+unsigned long seg_n, edge_n; // segments and edge updates, for "-T"
+time_t merge_tol = -1; // "-m", or -1 if intervals are not merged
+time_t quantum; // "-D", in seconds (or 0)
+unsigned long merge_n; // intervals that were merged
 
 static inline void
 who_graph_line(unsigned who_does, unsigned flags) {
-	struct hash_cursor c = hash_iter(gwho_hd, NULL, 0);
-	unsigned ref, ignore;
+	unsigned ref;
 
 	if (flags)
-		while (hash_next(&ref, &ignore, &c)) {
+		for (ref = 0; bits_next(&gwho, &ref); ref++) {
 			if (who_does == ref) {
 				if (flags <= 2 || flags == 5)
 					fputc('*', stderr);
@@ -139,7 +173,7 @@ who_graph_line(unsigned who_does, unsigned flags) {
 			}
 		}
 	else
-		while (hash_next(&ref, &ignore, &c))
+		for (ref = 0; bits_next(&gwho, &ref); ref++)
 			fputc('|', stderr);
 
 	fputc(' ', stderr);
@@ -149,454 +183,1839 @@ who_graph_line(unsigned who_does, unsigned flags) {
  * read functions
  ******/
 
-/* read person nickname and convert it to existing numeric id */
-static unsigned
-read_id(char **line)
+/* generate a new numeric id. They are handed out in order, from 0 */
+static inline unsigned
+id_new(void)
 {
-	unsigned id;
-	char username[USERNAME_MAX_LEN];
-	read_word(username, line, sizeof(username));
-	CBUG(shash_get(g_hd, &id, username));
-	return id;
+	return idm_n++;
 }
 
-/* read currency value and convert it to int */
-static inline long
-read_currency(char **line)
+/* the nickname of a numeric id */
+static inline char *
+id_str(unsigned id)
 {
-	return (long) (strtof(*line, line) * 100.0f);
+	CBUG(id >= id_name_n || id_name[id] == NO_ID);
+	return names_str(&names, id_name[id]);
 }
 
-/* create person id to nickname secondary DB items */
-void ig_assoc(void **result, uint32_t *len, void *key, void *value) {
-	*len = sizeof(unsigned);
-	* (unsigned **) result = value;
+/* convert an (interned) nickname to its existing numeric id */
+static inline unsigned
+name_id(unsigned name)
+{
+	CBUG(name >= nid_n || nid[name] == NO_ID);
+	return nid[name];
 }
 
-/******
- * ge (graph edges) functions
- ******/
-
-/* get debt between people */
-static long
-ge_get(unsigned id0, unsigned id1)
+/* make a nickname correspond to a numeric id */
+static void
+name_id_set(unsigned name, unsigned id)
 {
-	unsigned ids[2];
-	long ret;
-
-	if (id0 > id1) {
-		ids[0] = id1;
-		ids[1] = id0;
-	} else {
-		ids[0] = id0;
-		ids[1] = id1;
+	if (name >= nid_n) {
+		unsigned n = (name + 1) * 2;
+		nid = realloc(nid, n * sizeof(unsigned));
+		CBUG(!nid);
+		memset(nid + nid_n, 0xff, (n - nid_n) * sizeof(unsigned));
+		nid_n = n;
 	}
 
-	if (hash_get(ge_hd, &ret, ids, sizeof(ids)))
-		return 0;
+	nid[name] = id;
 
-	return id0 > id1 ? -ret : ret;
+	if (id >= id_name_n) {
+		unsigned n = (id + 1) * 2;
+		id_name = realloc(id_name, n * sizeof(unsigned));
+		CBUG(!id_name);
+		memset(id_name + id_name_n, 0xff,
+				(n - id_name_n) * sizeof(unsigned));
+		id_name_n = n;
+	}
+
+	id_name[id] = name;
 }
 
-/* add debt between people */
-static void
-ge_add(unsigned id_from, unsigned id_to, long value)
-{
-	unsigned ids[2];
-	long cvalue;
+/******
+ * ge (graph edges) functions (the rest are in ge.h)
+ ******/
 
-	if (id_from > id_to) {
-		ids[0] = id_to;
-		ids[1] = id_from;
-	} else {
-		ids[0] = id_from;
-		ids[1] = id_to;
+/* print cents as an amount with two decimal places, exactly */
+static inline void
+print_cents(FILE *fp, int64_t value)
+{
+	if (value < 0) {
+		fputc('-', fp);
+		value = -value;
 	}
 
-	cvalue = ge_get(id_from, id_to);
-
-	if (id_from > id_to)
-		value = - cvalue - value;
-	else
-		value = cvalue + value;
-
-	hash_put(ge_hd, ids, sizeof(ids), &value, sizeof(value));
+	fprintf(fp, "%lld.%02lld", (long long) (value / 100),
+			(long long) (value % 100));
 }
 
 /* show debt between a pair of two people */
 static inline void
-ge_show(unsigned from, unsigned to, long value)
+ge_show(unsigned from, unsigned to, int64_t value)
 {
-	char from_name[USERNAME_MAX_LEN];
-	char to_name[USERNAME_MAX_LEN];
-	uhash_pget(ig_hd, from_name, from);
-	uhash_pget(ig_hd, to_name, to);
+	char *from_name = id_str(from), *to_name = id_str(to);
 
 	if (value > 0)
-		printf("%s owes %s %.2f€\n", to_name, from_name,
-				((float) value) / 100.0f);
-	else
-		printf("%s owes %s %.2f€\n", from_name, to_name,
-				- ((float) value) / 100.0f);
+		printf("%s owes %s ", to_name, from_name);
+	else {
+		printf("%s owes %s ", from_name, to_name);
+		value = -value;
+	}
+
+	print_cents(stdout, value);
+	printf("€\n");
 }
 
 /* show all debt between people */
 static void
 ge_show_all()
 {
-	struct hash_cursor c = hash_iter(ge_hd, NULL, 0);
-	unsigned key[2];
-	unsigned long value;
+	struct ge_cur c = ge_iter(&ge);
+	unsigned lo, hi;
+	int64_t value;
 
-	while (hash_next(key, &value, &c))
-		ge_show(key[0], key[1], value);
+	while (ge_next(&ge, &lo, &hi, &value, &c))
+		ge_show(lo, hi, value);
 }
 
 /******
- * who (db of "current" people, for use in split calculation) related functions
+ * settlement
  ******/
 
-static inline void
-who_present() {
-	struct hash_cursor c = hash_iter(gwho_hd, NULL, 0);
-	unsigned who, ignore;
-	char name[USERNAME_MAX_LEN];
-	uhash_get(ig_hd, name, who);
-
-	while (hash_next(&who, &ignore, &c))
-		printf("%c %s\n",
-		       uhash_get(gwho_hd, &ignore, who) ? 'P' : 'A',
-		       name);
-}
+/* Paying every debt in the graph would take one transfer per edge, but
+ * people don't really care who they pay, as long as in the end everyone has
+ * paid what they owe. So we sum up everything each person owes and is owed
+ * (their balance), and then we repeatedly have the person who owes the most
+ * pay the person who is owed the most, as much as they can. Each transfer
+ * settles at least one of them, so there are fewer transfers than people.
+ */
 
-/* makes all provided matches lie within the provided interval [min, max] */
-static inline long
-pay(long long divident, long long divisor) {
-	return (divident % divisor ? PAYER_TIP : 0)
-		+ divident / divisor;
-}
+struct bal {
+	int64_t value;
+	unsigned id;
+};
 
-static inline void
-line_finish(char *line)
+static inline int
+bal_gt(struct bal *a, struct bal *b)
 {
-	if (*line && *line != '\n') {
-		if (*(line + 1) == '#')
-			fprintf(stderr, "%s", line);
-		else
-			fprintf(stderr, " #%s", line);
-	} else
-		fputc('\n', stderr);
+	return a->value > b->value || (a->value == b->value && a->id < b->id);
 }
 
-static inline void gdebug(time_t ts, unsigned id, char *label) {
-	char user[USERNAME_MAX_LEN];
-	uhash_pget(ig_hd, user, id);
-	char tss[DATE_MAX_LEN];
-	printtime(tss, ts);
-	fprintf(stderr, "%s %s %s", label, tss, user);
-}
+/* binary heap, biggest value at the top */
+static void
+bal_push(struct bal *heap, size_t *n, struct bal b)
+{
+	size_t i = (*n)++, up;
 
-/******
- * functions that process a valid type of line
- ******/
+	for (; i; i = up) {
+		up = (i - 1) / 2;
+		if (!bal_gt(&b, &heap[up]))
+			break;
+		heap[i] = heap[up];
+	}
 
-// https://softwareengineering.stackexchange.com/questions/363091/split-overlapping-ranges-into-all-unique-ranges/363096#363096
+	heap[i] = b;
+}
 
-/* This function is for handling lines in the format:
- *
- * PAY <DATE> <PERSON_ID> <AMOUNT> <START_DATE> <END_DATE> [...]
- *
- * It represents the act of paying a bill. It reads the id of the payer, a
- * monetary value, the start date and the end date for the billing period.
- * Then it fetches the intervals of BST A which match this time period, and it
- * "trims" them so that they lie only within it. After this, it splits the
- * billing period into sections (or splits) where the number of people present
- * differ. For a more visual representation of what is going on:
- *       l
- * o------------o - - - - - - - - - - - - -o
- *       el
- * o---------------------------------------o
- *       q
- * o---------------------------------------o
- * 
- * o------------o--------------------------o
- * x            w                          y
- *
- * For the billing period [x, y], we get the intervals:
- *
- * ([x, w], l), ([x, y], el), ([x, y], q).
- *
- * From this we construct the following splits:
- *
- * ([x, w], { l, el, q }), ([w, y], { el, q })
- *
- * There is also the possibility that there are periods of time that no one is
- * present, and this is also handled here. If no one is present but they are
- * still renting a room there, we introduce splits with the intervals from
- * BST B in the available gaps.
- *
- * From the obtained "splits" we then proceed to calculate how much each person
- * has to pay. Suppose the amount of the bill is A, and we have the splits
- * described above. For the first split, the amount per person would be:
- * PAYER_TIP + (w - x) * A / (y - x) * 3, and for the second:
- * PAYER_TIP + (y - w) * A / (y - x) * 2.
- *
- * I will spare you the gory details for now, but you can check out the
- * functions above.
- */
-void op_pay(time_t ts, char *line)
+static struct bal
+bal_pop(struct bal *heap, size_t *n)
 {
-	unsigned id;
-	long value;
-	time_t lmin = -1, min, max;
-	long long bill_interval;
+	struct bal top = heap[0], last = heap[--*n];
+	size_t i = 0, child;
 
-	id = read_id(&line);
-	value = read_currency(&line);
-	min = read_ts(&line);
-	max = read_ts(&line);
-	bill_interval = max - min;
-	/* char label[DATE_MAX_LEN * 2 + 1]; */
-	/* sprintf(label, "% */
-	if (pflags & PF_DEBUG) {
-		char mins[DATE_MAX_LEN], maxs[DATE_MAX_LEN];
-		who_graph_line(id, 5);
-		printtime(mins, min);
-		printtime(maxs, max);
-		gdebug(ts, id, "PAY");
-		fprintf(stderr, " %ld %s %s", value, mins, maxs);
-		line_finish(line);
+	for (; (child = i * 2 + 1) < *n; i = child) {
+		if (child + 1 < *n && bal_gt(&heap[child + 1], &heap[child]))
+			child++;
+		if (!bal_gt(&heap[child], &last))
+			break;
+		heap[i] = heap[child];
 	}
 
-	it_cur_t c = it_iter(p_itd, min, max);
-	unsigned who, count, cost, not_first = 0;
-	long long interval;
-
-	while (it_next(&min, &max, &count, &who, &c)) {
-		if (lmin != min) {
-			interval = max - min;
-			cost = pay(interval * value, count * bill_interval);
-
-			if (pflags & PF_DEBUG) {
-				if (not_first)
-					fprintf(stderr, "\n");
-				not_first = 1;
-				who_graph_line(-1, 0);
-				char smaxs[DATE_MAX_LEN];
-				printtime(smaxs, max);
-				fprintf(stderr, "  %s %lld %d", smaxs, interval, cost);
-			}
-			lmin = min;
-		}
+	heap[i] = last;
+	return top;
+}
 
-		char name[USERNAME_MAX_LEN];
-		uhash_pget(ig_hd, name, who);
-		if (who != id)
-			ge_add(id, who, cost);
-		ndebug(" %s", name);
+/* balance of each person (by id): positive if they are owed money */
+static int64_t *
+ge_balances(void)
+{
+	int64_t *bal = calloc(idm_n + 1, sizeof(int64_t)), value;
+	struct ge_cur c = ge_iter(&ge);
+	unsigned lo, hi;
+
+	CBUG(!bal);
+	while (ge_next(&ge, &lo, &hi, &value, &c)) {
+		bal[lo] += value;
+		bal[hi] -= value;
 	}
-	ndebug("\n");
+
+	return bal;
 }
 
-/* This function is for handling lines in the format:
- *
- * BUY <DATE> <PERSON_ID> <AMOUNT> [DESCRIPTION]
- *
- * It reads an existing id much like process_resume, and it also reads a
- * currency value. Then it sees which time intervals in BST B intersect with
- * the provided DATE. Then it divides the value by the number of matches it
- * got, and it adds PAYER_TIP to the result, which was added to make sure the
- * payer of the bill or of the shared goods does not lose money with rounding
- * errors. After this, it iterates over all the matches, adding the result
- * money owed to the read id (the payer), from the person that interval
- * belongs to.
- */
-void op_buy(time_t ts, char *line) {
-	it_cur_t c = it_iter(np_itd, ts, ts);
-	unsigned id, who;
-	long value, dvalue;
-	time_t lmin = -1, min, tign;
-	unsigned count;
+/* print the transfers that settle all balances, either as sentences or as
+ * TRANSFER lines that can be appended to the input */
+static void
+settle(int64_t *bal, unsigned n)
+{
+	struct bal *cred = malloc((n + 1) * sizeof(struct bal)),
+		   *debt = malloc((n + 1) * sizeof(struct bal)), c, d, b;
+	char tss[DATE_MAX_LEN];
+	size_t cred_n = 0, debt_n = 0;
+	int64_t value;
+	unsigned id;
 
-	id = read_id(&line);
-	value = read_currency(&line);
-	if (pflags & PF_DEBUG) {
-		who_graph_line(id, 5);
-		gdebug(ts, id, "BUY");
-		fprintf(stderr, " %ld", value);
-		line_finish(line);
-		who_graph_line(-1, 0);
+	CBUG(!cred || !debt);
+	printtime(tss, time(NULL));
+
+	for (id = 0; id < n; id++) {
+		b.id = id;
+		if (bal[id] > 0) {
+			b.value = bal[id];
+			bal_push(cred, &cred_n, b);
+		} else if (bal[id] < 0) {
+			b.value = -bal[id];
+			bal_push(debt, &debt_n, b);
+		}
 	}
 
-	// assert there are not multiple intervals with the same id?
-	while (it_next(&tign, &tign, &count, &who, &c)) {
-		char name[USERNAME_MAX_LEN];
-		dvalue = pay(value, count);
-		if (who != id)
-			ge_add(id, who, pay(value, count));
-		uhash_pget(ig_hd, name, who);
-		ndebug(" %ld %s", dvalue, name);
+	while (cred_n && debt_n) {
+		c = bal_pop(cred, &cred_n);
+		d = bal_pop(debt, &debt_n);
+		value = c.value < d.value ? c.value : d.value;
+
+		if (pflags & PF_SETTLE_LINES)
+			printf("TRANSFER %s %s %s ", tss, id_str(d.id),
+					id_str(c.id));
+		else
+			printf("%s pays %s ", id_str(d.id), id_str(c.id));
+		print_cents(stdout, value);
+		printf(pflags & PF_SETTLE_LINES ? "\n" : "€\n");
+
+		c.value -= value;
+		d.value -= value;
+		if (c.value)
+			bal_push(cred, &cred_n, c);
+		if (d.value)
+			bal_push(debt, &debt_n, d);
 	}
 
-	ndebug("\n");
+	free(cred);
+	free(debt);
 }
 
-/* This function is for handling lines in the format:
- *
- * TRANSFER <DATE> <FROM_PERSON_ID> <TO_PERSON_ID> <AMOUNT>
- *
- * It reads two existing PERSON_IDs and obtains their numeric ids, which are
- * assumed to exist. It also reads a currency value. Then it adds the value to
- * the edge between the first id and the second id, increasing the debt that
- * the second person owes to the first one by that value.
+/******
+ * net balances ("-n")
+ ******/
+
+/* With "-n", instead of the debt between each pair of people, we only keep
+ * how much each person is owed in all (negative if they owe), which is what
+ * their debts to and from everyone else add up to. This takes memory
+ * proportional to the number of people (not to its square), and a bill only
+ * changes the balances of the payer and of the people present. We can no
+ * longer tell who owes whom, but it is still enough to settle up.
  */
-void op_transfer(time_t ts, char *line) {
-	unsigned id_from, id_to;
-	long value;
 
-	id_from = read_id(&line);
-	id_to = read_id(&line);
-	value = read_currency(&line);
+struct net {
+	int64_t *v; // by id
+	unsigned n;
+} gnet;
 
-	if (pflags & PF_DEBUG) {
-		char id_from_s[USERNAME_MAX_LEN];
-		uhash_pget(ig_hd, id_from_s, id_from);
-		who_graph_line(id_from, 5);
-		gdebug(ts, id_from, "BUY");
-		fprintf(stderr, " %ld", value);
-		line_finish(line);
-	}
+static inline void
+net_grow(struct net *nt, unsigned id)
+{
+	unsigned n;
+
+	if (id < nt->n)
+		return;
 
-	ge_add(id_from, id_to, value);
+	n = (id + 1) * 2;
+	nt->v = realloc(nt->v, n * sizeof(int64_t));
+	CBUG(!nt->v);
+	memset(nt->v + nt->n, 0, (n - nt->n) * sizeof(int64_t));
+	nt->n = n;
 }
 
-/* This function is for handling lines in the format:
- *
- * STOP <DATE> <PERSON_ID>
- *
- * It reads a PERSON_ID, and it checks if there is a correspondant graph node
- * (and so a numeric id). If there is one, it finishes the last intervals in
- * both BSTs (much like process_pause does for BST A). If there isn't a graph
- * node for that user (and therefore no numeric id), it generates one. Then it
- * inserts the time interval [-∞, DATE] (and the newly created id) into both
- * BSTs.
- */
-void op_stop(time_t ts, char *line) {
-	char username[USERNAME_MAX_LEN];
-	unsigned id;
+/* like ge_add: id_to owes id_from value more */
+static inline void
+net_add(struct net *nt, unsigned id_from, unsigned id_to, int64_t value)
+{
+	net_grow(nt, id_from > id_to ? id_from : id_to);
+	nt->v[id_from] += value;
+	nt->v[id_to] -= value;
+}
 
-	read_word(username, &line, sizeof(username));
-	shash_get(g_hd, &id, username);
+/* like ge_add_row: who[i] owes id owe[i] more, for each of the n of them */
+static inline void
+net_add_row(struct net *nt, unsigned id, unsigned *who, int64_t *owe,
+		unsigned n)
+{
+	int64_t sum = 0;
+	unsigned i;
 
-	if (shash_get(g_hd, &id, username)) {
-		unsigned id = idm_new(&idm);
-		suhash_put(g_hd, username, id);
+	for (i = 0; i < n; i++) {
+		net_grow(nt, who[i]);
+		nt->v[who[i]] -= owe[i];
+		sum += owe[i];
 	}
 
-	if (pflags & PF_DEBUG) {
-		who_graph_line(id, 1);
-		gdebug(ts, id, "STOP");
-		line_finish(line);
-		who_graph_line(id, 3);
-		fputc('\n', stderr);
-	}
+	net_grow(nt, id);
+	nt->v[id] += sum;
+}
 
-	uhash_del(gwho_hd, id);
-	uhash_del(gnpwho_hd, id);
+static inline void
+net_merge(struct net *dst, struct net *src)
+{
+	unsigned i;
 
-	it_stop(p_itd, ts, id);
-	it_stop(np_itd, ts, id);
+	if (src->n)
+		net_grow(dst, src->n - 1);
+	for (i = 0; i < src->n; i++)
+		dst->v[i] += src->v[i];
 }
 
-/* This function is for handling lines in the format:
- *
- * RESUME <DATE> <PERSON_ID>
- *
- * So it reads an existing PERSON_ID and obtains the correspondant numeric id,
- * then it inserts the interval [DATE, +∞] (and the id) into BST A. It differs
- * from process_start in the sense that it assumes that the numeric id is
- * already present, and also because it never inserts the interval into BST B.
- */
-void op_resume(time_t ts, char *line) {
-	unsigned id, ignore;
+/* balances for settle (like ge_balances) */
+static int64_t *
+net_balances(void)
+{
+	int64_t *bal = calloc(idm_n + 1, sizeof(int64_t));
 
-	id = read_id(&line);
-	CBUG(!uhash_get(gwho_hd, &ignore, id));
-	CBUG(uhash_get(gnpwho_hd, &ignore, id));
-	uhash_put(gwho_hd, id, &id, sizeof(unsigned));
-	if (pflags & PF_DEBUG) {
-		who_graph_line(id, 4);
-		fputc('\n', stderr);
-		who_graph_line(id, 2);
-		gdebug(ts, id, "RESUME");
-		line_finish(line);
-	}
-	// TODO assert no interval for id at this ts
-	it_start(p_itd, ts, id);
+	CBUG(!bal);
+	memcpy(bal, gnet.v, (gnet.n < idm_n ? gnet.n : idm_n)
+			* sizeof(int64_t));
+	return bal;
 }
 
-/* This function is for handling lines in the format:
- *
- * PAUSE <DATE> <PERSON_ID>
- *
- * As such, it reads an existing PERSON_ID, and fetches the numeric id to which
- * it corresponds. After that, it grabs the last time interval that is present
- * that belongs to that person, and finishes it at the read DATE
- * (only in BST A).
- *
- * For example, if the preceding line was:
- *
- * START <DATE_A> joseph
- *
- * And therefore, the most recent interval for joseph was [DATE_A, +∞], a line
- * like:
- *
- * PAUSE <DATE_B> joseph
- *
- * Would update this interval to [DATE_A, DATE_B], but only for BST A.
- */
-void op_pause(time_t ts, char *line) {
+static void
+net_show_all(void)
+{
 	unsigned id;
 
-	id = read_id(&line);
-	if (pflags & PF_DEBUG) {
-		who_graph_line(id, 1);
-		gdebug(ts, id, "PAUSE");
-		line_finish(line);
-		who_graph_line(id, 3);
-		fputc('\n', stderr);
+	for (id = 0; id < gnet.n && id < idm_n; id++) {
+		if (!gnet.v[id])
+			continue;
+		if (gnet.v[id] > 0)
+			printf("%s is owed ", id_str(id));
+		else
+			printf("%s owes ", id_str(id));
+		print_cents(stdout, gnet.v[id] > 0 ? gnet.v[id] : -gnet.v[id]);
+		printf("€\n");
 	}
-	uhash_del(gwho_hd, id);
-	// TODO assert interval for id at this ts
-	it_stop(p_itd, ts, id);
 }
 
-/* This function is for handling lines in the format:
- *
- * START <DATE> <PERSON_ID> [<PHONE_NUMBER> <EMAIL> ... <NAME>]
+/******
+ * who (db of "current" people, for use in split calculation) related functions
+ ******/
+
+/* show who is renting, and if they are present (P) or away (A) */
+static inline void
+who_present() {
+	unsigned who;
+
+	for (who = 0; bits_next(&gnpwho, &who); who++)
+		printf("%c %s\n", bits_get(&gwho, who) ? 'P' : 'A',
+				id_str(who));
+}
+
+/******
+ * interval logs (the BSTs)
+ ******/
+
+/* Bills of different kinds (gas, light, water) often have the same billing
+ * period, so we remember the segments of the last few periods that were
+ * asked for (and who was in each of them), and go through those instead of
+ * asking again (see pay_eval and memo_next). If someone starts or stops
+ * being there before the end of one of them, it is forgotten.
+ */
+
+#define MEMO_N 8
+
+struct memo_seg {
+	time_t min, max;
+	unsigned count; // people there (as the cursor says)
+	unsigned lo, n; // who they are: memo.who from lo to lo + n - 1
+};
+
+struct memo {
+	time_t min, max; // the billing period (min >= max if not in use)
+	struct memo_seg *seg;
+	unsigned seg_n, seg_cap;
+	unsigned *who;
+	unsigned who_n, who_cap;
+} memo[MEMO_N];
+
+unsigned memo_last; // the one that was filled last
+
+/* someone started or stopped being there at ts */
+static inline void
+memo_touch(time_t ts)
+{
+	unsigned i;
+
+	for (i = 0; i < MEMO_N; i++)
+		if (ts < memo[i].max)
+			memo[i].min = memo[i].max = 0;
+}
+
+/* who is present, and who is renting (present or paused), see ivl.h */
+struct ivlog p_log = { .touch = memo_touch }, np_log;
+
+/* With "-m", the latest interval of id, if it finished no more than
+ * merge_tol seconds before ts (index + 1, or 0) */
+static inline size_t
+ivl_mergeable(struct ivlog *log, time_t ts, unsigned id)
+{
+	struct ivl *iv;
+
+	if (merge_tol < 0 || id >= log->last_n || !log->last[id])
+		return 0;
+
+	iv = &log->v[log->last[id] - 1];
+	if (iv->max == TS_OPEN || iv->max > ts || ts - iv->max > merge_tol)
+		return 0;
+
+	return log->last[id];
+}
+
+/* start that interval again (instead of there being a new one). Returns 0
+ * if it didn't */
+static int
+ivl_merge(struct ivlog *log, time_t ts, unsigned id)
+{
+	struct ivl *iv;
+	time_t t;
+	size_t i;
+
+#ifdef USE_LIBIT
+	/* (libit's intervals can't be changed) */
+	return 0;
+#endif
+
+	i = ivl_mergeable(log, ts, id);
+	if (!i)
+		return 0;
+
+	iv = &log->v[--i];
+	t = iv->max;
+	iv->max = TS_OPEN;
+	ivt_set(log, i);
+
+	if (!tl_unstop(&log->tl, t, id, ivl_ends_at(log, t))) {
+		iv->max = t;
+		ivt_set(log, i);
+		return 0;
+	}
+
+	if (log->touch)
+		log->touch(t);
+	merge_n++;
+	return 1;
+}
+
+/* what we remember about the billing period [min, max], or NULL */
+static inline struct memo *
+memo_get(time_t min, time_t max)
+{
+	unsigned i;
+
+	for (i = 0; i < MEMO_N; i++)
+		if (memo[i].min == min && memo[i].max == max && min < max)
+			return &memo[i];
+
+	return NULL;
+}
+
+/* an empty one, to remember [min, max] in (instead of the oldest one) */
+static inline struct memo *
+memo_new(time_t min, time_t max)
+{
+	struct memo *m;
+
+	memo_last = (memo_last + 1) % MEMO_N;
+	m = &memo[memo_last];
+	m->min = min;
+	m->max = max;
+	m->seg_n = m->who_n = 0;
+	return m;
+}
+
+/* remember that who was there from min to max, with count people */
+static inline void
+memo_add(struct memo *m, time_t min, time_t max, unsigned count,
+		unsigned who)
+{
+	struct memo_seg *sg = m->seg_n ? &m->seg[m->seg_n - 1] : NULL;
+
+	if (!sg || sg->min != min) {
+		if (m->seg_n >= m->seg_cap) {
+			m->seg_cap = m->seg_cap ? m->seg_cap * 2 : 16;
+			m->seg = realloc(m->seg,
+					m->seg_cap * sizeof(struct memo_seg));
+			CBUG(!m->seg);
+		}
+		sg = &m->seg[m->seg_n++];
+		sg->min = min;
+		sg->max = max;
+		sg->count = count;
+		sg->lo = m->who_n;
+		sg->n = 0;
+	}
+
+	if (m->who_n >= m->who_cap) {
+		m->who_cap = m->who_cap ? m->who_cap * 2 : 64;
+		m->who = realloc(m->who, m->who_cap * sizeof(unsigned));
+		CBUG(!m->who);
+	}
+
+	m->who[m->who_n++] = who;
+	sg->n++;
+}
+
+/* go through the segments that m remembers */
+static inline struct ivl_cur
+memo_iter(struct memo *m)
+{
+	struct ivl_cur c;
+
+	memset(&c, 0, sizeof(c));
+	c.m = m;
+	return c;
+}
+
+static inline int
+memo_next(time_t *min, time_t *max, unsigned *count, unsigned *who,
+		struct ivl_cur *c)
+{
+	struct memo_seg *sg;
+
+	for (; c->m_s < c->m->seg_n; c->m_s++, c->m_w = 0) {
+		sg = &c->m->seg[c->m_s];
+		if (c->m_w >= sg->n)
+			continue;
+		*min = sg->min;
+		*max = sg->max;
+		*count = sg->count;
+		*who = c->m->who[sg->lo + c->m_w++];
+		return 1;
+	}
+
+	return 0;
+}
+
+static inline struct ivl_cur
+ivl_iter(struct ivlog *log, time_t min, time_t max)
+{
+#ifndef IT_QUERY
+	if (!log->tl.unordered && min <= max)
+		return tl_iter(&log->tl, log->tl.n, min, max);
+#endif
+#ifdef USE_LIBIT
+	struct ivl_cur c;
+
+	memset(&c, 0, sizeof(c));
+	c.use_it = 1;
+	c.it = it_iter(log->itd, min, max);
+	return c;
+#else
+	return ivt_iter(log, min, max);
+#endif
+}
+
+static inline int
+ivl_next(time_t *min, time_t *max, unsigned *count, unsigned *who,
+		struct ivl_cur *c)
+{
+	if (c->m)
+		return memo_next(min, max, count, who, c);
+
+	if (c->use_it)
+#ifdef USE_LIBIT
+		return it_next(min, max, count, who, &c->it);
+#else
+		return ivt_next(min, max, count, who, c);
+#endif
+
+	return tl_next(min, max, count, who, c);
+}
+
+/* makes all provided matches lie within the provided interval [min, max] */
+static inline int64_t
+pay(__int128 divident, int64_t divisor) {
+	return (divident % divisor ? PAYER_TIP : 0)
+		+ divident / divisor;
+}
+
+/* Where the debt that a PAY or a BUY adds goes (the graph, or one that a
+ * thread has for itself, see pend_flush), and how much work it was.
+ *
+ * A PAY adds to what the same people owe the payer in each segment, so
+ * instead of changing the graph every time, we add it up: who has the ids
+ * of the people that owe something, and owe how much each of them owes, in
+ * the same order. When the line is done, the graph is changed once per
+ * person (see acc_flush).
+ *
+ * To find where someone is in who, there is a slot for each id, which is
+ * only good if its stamp is the one of the current line (so there is nothing
+ * to clear between lines).
+ */
+struct acc_slot {
+	unsigned stamp, i;
+};
+
+struct acc {
+	struct ge *ge;
+	struct net *net; // instead of ge, with "-n"
+	unsigned long seg_n, edge_n;
+	unsigned *who, who_n, who_cap;
+	int64_t *owe;
+	struct acc_slot *slot; // by id
+	unsigned slot_n, stamp;
+	struct ivt_res res; // for pay_prefix
+};
+
+struct acc gacc = { .ge = &ge }; // the one of the main thread
+struct ge vge; // with "-V", the debt of the lines written down, worked out
+struct net vnet; // (or balances, with "-n") the usual way (see ev_run)
+struct acc vacc = { .ge = &vge };
+
+/* who owes the payer cost (and isn't in who yet) */
+static inline void
+acc_push(struct acc *a, unsigned who, int64_t cost)
+{
+	if (a->who_n >= a->who_cap) {
+		a->who_cap = a->who_cap ? a->who_cap * 2 : 64;
+		a->who = realloc(a->who, a->who_cap * sizeof(unsigned));
+		a->owe = realloc(a->owe, a->who_cap * sizeof(int64_t));
+		CBUG(!a->who || !a->owe);
+	}
+
+	a->who[a->who_n] = who;
+	a->owe[a->who_n++] = cost;
+}
+
+/* who owes the payer cost more */
+static inline void
+acc_owe(struct acc *a, unsigned who, int64_t cost)
+{
+	struct acc_slot *s;
+
+	if (who >= a->slot_n) {
+		unsigned n = (who + 1) * 2;
+		a->slot = realloc(a->slot, n * sizeof(struct acc_slot));
+		CBUG(!a->slot);
+		memset(a->slot + a->slot_n, 0,
+				(n - a->slot_n) * sizeof(struct acc_slot));
+		a->slot_n = n;
+	}
+
+	s = &a->slot[who];
+	if (s->stamp == a->stamp + 1) {
+		a->owe[s->i] += cost;
+		return;
+	}
+
+	s->stamp = a->stamp + 1;
+	s->i = a->who_n;
+	acc_push(a, who, cost);
+}
+
+/* add what was added up to the graph, as debt to the payer (id) */
+static inline void
+acc_flush(struct acc *a, unsigned id)
+{
+	if (a->net)
+		net_add_row(a->net, id, a->who, a->owe, a->who_n);
+	else
+		ge_add_row(a->ge, id, a->who, a->owe, a->who_n);
+	a->edge_n += a->who_n;
+	a->who_n = 0;
+
+	/* after 2^32 - 1 lines, stamps start over */
+	if (++a->stamp == (unsigned) -1) {
+		memset(a->slot, 0, a->slot_n * sizeof(struct acc_slot));
+		a->stamp = 0;
+	}
+}
+
+static inline void
+acc_free(struct acc *a)
+{
+	free(a->who);
+	free(a->owe);
+	free(a->slot);
+	free(a->res.v);
+}
+
+static inline void
+line_finish(char *line, char *end)
+{
+	int len = end - line;
+
+	if (line < end && *line != '\n') {
+		if (line + 1 < end && *(line + 1) == '#')
+			fprintf(stderr, "%.*s", len, line);
+		else
+			fprintf(stderr, " #%.*s", len, line);
+	} else
+		fputc('\n', stderr);
+}
+
+static inline void gdebug(time_t ts, unsigned id, char *label) {
+	char tss[DATE_MAX_LEN];
+	printtime(tss, ts);
+	fprintf(stderr, "%s %s %s", label, tss, id_str(id));
+}
+
+/******
+ * functions that process a valid type of line
+ ******/
+
+// https://softwareengineering.stackexchange.com/questions/363091/split-overlapping-ranges-into-all-unique-ranges/363096#363096
+
+/* add to a->ge what each person owes the payer (id) of a bill, going through
+ * the segments of its billing period with c (and remembering them in rec,
+ * if it's not NULL) */
+static void
+pay_eval(struct acc *a, unsigned id, int64_t value, long long bill_interval,
+		struct ivl_cur *c, struct memo *rec)
+{
+	unsigned who, count, not_first = 0;
+	int64_t cost = 0;
+	time_t lmin = -1, min, max;
+	long long interval;
+
+	while (ivl_next(&min, &max, &count, &who, c)) {
+		if (lmin != min) {
+			a->seg_n++;
+			interval = max - min;
+			cost = pay((__int128) interval * value,
+					count * bill_interval);
+
+			if (pflags & PF_DEBUG) {
+				if (not_first)
+					fprintf(stderr, "\n");
+				not_first = 1;
+				who_graph_line(-1, 0);
+				char smaxs[DATE_MAX_LEN];
+				printtime(smaxs, max);
+				fprintf(stderr, "  %s %lld %lld", smaxs, interval,
+						(long long) cost);
+			}
+			lmin = min;
+		}
+
+		if (rec)
+			memo_add(rec, min, max, count, who);
+		if (who != id)
+			acc_owe(a, who, cost);
+		ndebug(" %s", id_str(who));
+	}
+	ndebug("\n");
+	acc_flush(a, id);
+}
+
+/* The same as pay_eval, but with the prefix integrals of the timeline ("-e
+ * prefix"): for each interval in the billing period, what its person owes
+ * is the difference of two of them (see tl_point), and it is only divided by
+ * the length of the bill (and the payer's tip added) once per person. So it
+ * takes the same time, however many segments the period has, and what each
+ * person pays can be a few cents less than with segments. */
+static void
+pay_prefix(struct acc *a, unsigned id, int64_t value, long long bill_interval,
+		time_t min, time_t max)
+{
+	struct timeline *tl = &p_log.tl;
+	struct ivl *iv;
+	__int128 d = (__int128) G_SCALE * bill_interval, x;
+	int64_t g;
+	unsigned i;
+
+	a->res.n = 0;
+	if (p_log.leaves)
+		ivt_find(&p_log, &a->res, 1, 0, p_log.leaves,
+				ivl_count(&p_log, max - 1), min);
+
+	for (i = 0; i < a->res.n; i++) {
+		iv = &p_log.v[a->res.v[i]];
+		if (iv->id == id)
+			continue;
+		g = tl_integral(tl, iv->max < max ? iv->max : max)
+			- tl_integral(tl, iv->min > min ? iv->min : min);
+		/* (an interval with no length in the period isn't in any of
+		 * its segments, so it owes nothing) */
+		if (g)
+			acc_owe(a, iv->id, g);
+	}
+
+	if (pflags & PF_DEBUG)
+		who_graph_line(-1, 0);
+
+	for (i = 0; i < a->who_n; i++) {
+		x = (__int128) value * a->owe[i];
+		a->owe[i] = x / d + (x % d ? PAYER_TIP : 0);
+		ndebug(" %lld %s", (long long) a->owe[i], id_str(a->who[i]));
+	}
+
+	ndebug("\n");
+	acc_flush(a, id);
+}
+
+/* if pay_prefix can be used for a billing period (otherwise, we go through
+ * its segments) */
+static inline int
+prefix_ok(time_t min, time_t max)
+{
+	return (pflags & PF_PREFIX) && !p_log.tl.unordered && min < max;
+}
+
+/* This function is for handling lines in the format:
+ *
+ * PAY <DATE> <PERSON_ID> <AMOUNT> <START_DATE> <END_DATE> [...]
+ *
+ * It represents the act of paying a bill. It reads the id of the payer, a
+ * monetary value, the start date and the end date for the billing period.
+ * Then it fetches the intervals of BST A which match this time period, and it
+ * "trims" them so that they lie only within it. After this, it splits the
+ * billing period into sections (or splits) where the number of people present
+ * differ. For a more visual representation of what is going on:
+ *       l
+ * o------------o - - - - - - - - - - - - -o
+ *       el
+ * o---------------------------------------o
+ *       q
+ * o---------------------------------------o
+ * 
+ * o------------o--------------------------o
+ * x            w                          y
+ *
+ * For the billing period [x, y], we get the intervals:
+ *
+ * ([x, w], l), ([x, y], el), ([x, y], q).
+ *
+ * From this we construct the following splits:
+ *
+ * ([x, w], { l, el, q }), ([w, y], { el, q })
+ *
+ * There is also the possibility that there are periods of time that no one is
+ * present, and this is also handled here. If no one is present but they are
+ * still renting a room there, we introduce splits with the intervals from
+ * BST B in the available gaps.
+ *
+ * From the obtained "splits" we then proceed to calculate how much each person
+ * has to pay. Suppose the amount of the bill is A, and we have the splits
+ * described above. For the first split, the amount per person would be:
+ * PAYER_TIP + (w - x) * A / (y - x) * 3, and for the second:
+ * PAYER_TIP + (y - w) * A / (y - x) * 2.
+ *
+ * I will spare you the gory details for now, but you can check out the
+ * functions above.
+ */
+void op_pay(struct ev *ev)
+{
+	unsigned id;
+	int64_t value;
+	time_t min, max;
+	long long bill_interval;
+	struct memo *m;
+
+	id = name_id(ev->who);
+	value = ev->value;
+	min = ev->min;
+	max = ev->max;
+	bill_interval = max - min;
+	/* char label[DATE_MAX_LEN * 2 + 1]; */
+	/* sprintf(label, "% */
+	if (pflags & PF_DEBUG) {
+		char mins[DATE_MAX_LEN], maxs[DATE_MAX_LEN];
+		who_graph_line(id, 5);
+		printtime(mins, min);
+		printtime(maxs, max);
+		gdebug(ev->ts, id, "PAY");
+		fprintf(stderr, " %lld %s %s", (long long) value, mins, maxs);
+		line_finish(ev->rest, ev->end);
+	}
+
+	gacc.seg_n = gacc.edge_n = 0;
+	if (prefix_ok(min, max))
+		pay_prefix(&gacc, id, value, bill_interval, min, max);
+	else if ((m = memo_get(min, max))) {
+		struct ivl_cur c = memo_iter(m);
+		pay_eval(&gacc, id, value, bill_interval, &c, NULL);
+	} else {
+		struct ivl_cur c = ivl_iter(&p_log, min, max);
+		pay_eval(&gacc, id, value, bill_interval, &c,
+				min < max ? memo_new(min, max) : NULL);
+	}
+	seg_n += gacc.seg_n;
+	edge_n += gacc.edge_n;
+}
+
+/* add to a->ge what each person renting owes the buyer (id) */
+static void
+buy_eval(struct acc *a, unsigned id, int64_t value, struct ivl_cur *c)
+{
+	unsigned who, count;
+	int64_t dvalue;
+	time_t tign;
+
+	// assert there are not multiple intervals with the same id?
+	while (ivl_next(&tign, &tign, &count, &who, c)) {
+		dvalue = pay(value, count);
+		/* each person is only here once */
+		if (who != id)
+			acc_push(a, who, dvalue);
+		ndebug(" %lld %s", (long long) dvalue, id_str(who));
+	}
+
+	ndebug("\n");
+	acc_flush(a, id);
+}
+
+/* Many BUYs can be in a row without anyone coming or going, and then they
+ * are split among the same people. So each person owes a buyer the same for
+ * all of them as the sum of what they owe for each, and instead of changing
+ * the graph for every BUY, we add up, for each buyer, what everyone there
+ * owes them (fold_add), and change it once (fold_flush), before someone
+ * comes or goes, or the graph is looked at.
+ */
+
+#define FOLD_MAX 16 // buyers at a time
+
+struct fold {
+	size_t i; // the point of the timeline the BUYs are at (index + 1)
+	time_t ts; // of the first of them
+	unsigned payer[FOLD_MAX];
+	int64_t sum[FOLD_MAX];
+	unsigned n;
+	unsigned *who, who_n, who_cap; // the people there
+} gfold;
+
+static void
+fold_flush(void)
+{
+	struct acc *a;
+	struct ivl_cur c;
+	unsigned who, count, i, j;
+	time_t tign;
+
+	if (!gfold.n)
+		return;
+
+	c = ivl_iter(&np_log, gfold.ts, gfold.ts);
+	gfold.who_n = 0;
+	while (ivl_next(&tign, &tign, &count, &who, &c)) {
+		if (gfold.who_n >= gfold.who_cap) {
+			gfold.who_cap = gfold.who_cap ? gfold.who_cap * 2 : 64;
+			gfold.who = realloc(gfold.who,
+					gfold.who_cap * sizeof(unsigned));
+			CBUG(!gfold.who);
+		}
+		gfold.who[gfold.who_n++] = who;
+	}
+
+	/* (with "-V", the BUYs that are added up were all written down
+	 * first, see ev_run) */
+	a = pflags & PF_PARITY ? &vacc : &gacc;
+	a->edge_n = 0;
+	for (i = 0; i < gfold.n; i++) {
+		for (j = 0; j < gfold.who_n; j++)
+			if (gfold.who[j] != gfold.payer[i])
+				acc_push(a, gfold.who[j], gfold.sum[i]);
+		acc_flush(a, gfold.payer[i]);
+	}
+	edge_n += a->edge_n;
+	gfold.n = 0;
+}
+
+/* add a BUY to the ones waiting, if we can. Returns 0 if it has to be
+ * worked out now */
+static int
+fold_add(unsigned id, time_t ts, int64_t value)
+{
+	struct timeline *tl = &np_log.tl;
+	size_t i;
+	unsigned k;
+
+	if (tl->unordered)
+		return 0;
+
+	i = tl_find(tl, tl->n, ts);
+	if (!i || !tl->v[i - 1].count)
+		return 0;
+
+	if (gfold.n && gfold.i != i)
+		fold_flush();
+
+	for (k = 0; k < gfold.n && gfold.payer[k] != id; k++);
+
+	if (k == gfold.n) {
+		if (k == FOLD_MAX) {
+			fold_flush();
+			k = 0;
+		}
+		gfold.i = i;
+		gfold.ts = ts;
+		gfold.payer[k] = id;
+		gfold.sum[k] = 0;
+		gfold.n = k + 1;
+	}
+
+	gfold.sum[k] += pay(value, tl->v[i - 1].count);
+	return 1;
+}
+
+/* This function is for handling lines in the format:
+ *
+ * BUY <DATE> <PERSON_ID> <AMOUNT> [DESCRIPTION]
+ *
+ * It reads an existing id much like process_resume, and it also reads a
+ * currency value. Then it sees which time intervals in BST B intersect with
+ * the provided DATE. Then it divides the value by the number of matches it
+ * got, and it adds PAYER_TIP to the result, which was added to make sure the
+ * payer of the bill or of the shared goods does not lose money with rounding
+ * errors. After this, it iterates over all the matches, adding the result
+ * money owed to the read id (the payer), from the person that interval
+ * belongs to.
+ */
+void op_buy(struct ev *ev) {
+	struct ivl_cur c;
+	unsigned id;
+	int64_t value;
+
+	id = name_id(ev->who);
+	value = ev->value;
+
+	/* (with "-d", we show what each of them adds, and with "-T", how
+	 * long each of them takes) */
+	if (!(pflags & (PF_DEBUG | PF_TIMING)) && fold_add(id, ev->ts, value))
+		return;
+
+	c = ivl_iter(&np_log, ev->ts, ev->ts);
+	if (pflags & PF_DEBUG) {
+		who_graph_line(id, 5);
+		gdebug(ev->ts, id, "BUY");
+		fprintf(stderr, " %lld", (long long) value);
+		line_finish(ev->rest, ev->end);
+		who_graph_line(-1, 0);
+	}
+
+	gacc.edge_n = 0;
+	buy_eval(&gacc, id, value, &c);
+	edge_n += gacc.edge_n;
+}
+
+/* This function is for handling lines in the format:
+ *
+ * TRANSFER <DATE> <FROM_PERSON_ID> <TO_PERSON_ID> <AMOUNT>
+ *
+ * It reads two existing PERSON_IDs and obtains their numeric ids, which are
+ * assumed to exist. It also reads a currency value. Then it adds the value to
+ * the edge between the first id and the second id, increasing the debt that
+ * the second person owes to the first one by that value.
+ */
+void op_transfer(struct ev *ev) {
+	unsigned id_from, id_to;
+	int64_t value;
+
+	id_from = name_id(ev->who);
+	id_to = name_id(ev->who2);
+	value = ev->value;
+
+	if (pflags & PF_DEBUG) {
+		who_graph_line(id_from, 5);
+		gdebug(ev->ts, id_from, "BUY");
+		fprintf(stderr, " %lld", (long long) value);
+		line_finish(ev->rest, ev->end);
+	}
+
+	if (pflags & PF_NET)
+		net_add(&gnet, id_from, id_to, value);
+	else
+		ge_add(&ge, id_from, id_to, value);
+	edge_n++;
+}
+
+/* This function is for handling lines in the format:
+ *
+ * STOP <DATE> <PERSON_ID>
+ *
+ * It reads a PERSON_ID, and it checks if there is a correspondant graph node
+ * (and so a numeric id). If there is one, it finishes the last intervals in
+ * both BSTs (much like process_pause does for BST A). If there isn't a graph
+ * node for that user (and therefore no numeric id), it generates one. Then it
+ * inserts the time interval [-∞, DATE] (and the newly created id) into both
+ * BSTs.
+ */
+void op_stop(struct ev *ev) {
+	time_t ts = ev->ts;
+	unsigned id;
+
+	if (ev->who >= nid_n || nid[ev->who] == NO_ID) {
+		id = id_new();
+		name_id_set(ev->who, id);
+	} else
+		id = nid[ev->who];
+
+	if (pflags & PF_DEBUG) {
+		who_graph_line(id, 1);
+		gdebug(ts, id, "STOP");
+		line_finish(ev->rest, ev->end);
+		who_graph_line(id, 3);
+		fputc('\n', stderr);
+	}
+
+	bits_clr(&gwho, id);
+	bits_clr(&gnpwho, id);
+
+	ivl_stop(&p_log, ts, id);
+	ivl_stop(&np_log, ts, id);
+}
+
+/* This function is for handling lines in the format:
+ *
+ * RESUME <DATE> <PERSON_ID>
+ *
+ * So it reads an existing PERSON_ID and obtains the correspondant numeric id,
+ * then it inserts the interval [DATE, +∞] (and the id) into BST A. It differs
+ * from process_start in the sense that it assumes that the numeric id is
+ * already present, and also because it never inserts the interval into BST B.
+ */
+void op_resume(struct ev *ev) {
+	time_t ts = ev->ts;
+	unsigned id;
+
+	id = name_id(ev->who);
+	CBUG(!bits_get(&gnpwho, id));
+	CBUG(bits_get(&gwho, id));
+	bits_set(&gwho, id);
+	if (pflags & PF_DEBUG) {
+		who_graph_line(id, 4);
+		fputc('\n', stderr);
+		who_graph_line(id, 2);
+		gdebug(ts, id, "RESUME");
+		line_finish(ev->rest, ev->end);
+	}
+	// TODO assert no interval for id at this ts
+	if (!ivl_merge(&p_log, ts, id))
+		ivl_start(&p_log, ts, id);
+}
+
+/* This function is for handling lines in the format:
+ *
+ * PAUSE <DATE> <PERSON_ID>
+ *
+ * As such, it reads an existing PERSON_ID, and fetches the numeric id to which
+ * it corresponds. After that, it grabs the last time interval that is present
+ * that belongs to that person, and finishes it at the read DATE
+ * (only in BST A).
+ *
+ * For example, if the preceding line was:
+ *
+ * START <DATE_A> joseph
+ *
+ * And therefore, the most recent interval for joseph was [DATE_A, +∞], a line
+ * like:
+ *
+ * PAUSE <DATE_B> joseph
+ *
+ * Would update this interval to [DATE_A, DATE_B], but only for BST A.
+ */
+void op_pause(struct ev *ev) {
+	time_t ts = ev->ts;
+	unsigned id;
+
+	id = name_id(ev->who);
+	if (pflags & PF_DEBUG) {
+		who_graph_line(id, 1);
+		gdebug(ts, id, "PAUSE");
+		line_finish(ev->rest, ev->end);
+		who_graph_line(id, 3);
+		fputc('\n', stderr);
+	}
+	bits_clr(&gwho, id);
+	// TODO assert interval for id at this ts
+	ivl_stop(&p_log, ts, id);
+}
+
+/* give the id of a nickname the first "nickname~N" that isn't taken, so that
+ * the nickname can have a new one (see op_start) */
+static void
+name_retire(unsigned name)
+{
+	char base[USERNAME_MAX_LEN], buf[USERNAME_MAX_LEN + 16];
+	unsigned g, n, id = nid[name];
+	int len;
+
+	/* (copied, since names_get can move the names. Leaving room for the
+	 * number, as names are cut at USERNAME_MAX_LEN) */
+	snprintf(base, sizeof(base), "%.*s", USERNAME_MAX_LEN - 12,
+			names_str(&names, name));
+
+	for (g = 1; ; g++) {
+		len = snprintf(buf, sizeof(buf), "%s~%u", base, g);
+		n = names_get(&names, buf, len);
+		if (n >= nid_n || nid[n] == NO_ID)
+			break;
+	}
+
+	name_id_set(n, id);
+}
+
+/* This function is for handling lines in the format:
+ *
+ * START <DATE> <PERSON_ID> [<PHONE_NUMBER> <EMAIL> ... <NAME>]
  *
  * So it reads a textual person id, then it inserts it into the graph as a
  * node, generating a numeric id. Then it inserts the time interval [DATE, +∞]
  * along with that numeric id into both BST A and BST B.
+ *
+ * If the person id is of someone who stopped renting, they are the same
+ * person, and keep their numeric id (and their debts). Unless it ends with
+ * "~" (like "tomas~"): then the one who stopped becomes "tomas~1" (or ~2, if
+ * there is one, and so on), and "tomas" is someone new.
  */
-void op_start(time_t ts, char *line) {
-	char username[USERNAME_MAX_LEN];
-	unsigned id;
+void op_start(struct ev *ev) {
+	time_t ts = ev->ts;
+	char base[USERNAME_MAX_LEN], *s = names_str(&names, ev->who);
+	size_t len = strlen(s);
+	unsigned id, name = ev->who;
+	int merged = 0, fresh = 0;
+
+	if (len > 1 && s[len - 1] == '~') {
+		/* (names_get can move the names, and s with them) */
+		memcpy(base, s, len - 1);
+		name = names_get(&names, base, len - 1);
+		fresh = 1;
+	}
+
+	id = name < nid_n ? nid[name] : NO_ID;
+	if (id != NO_ID && fresh)
+		name_retire(name);
+
+	if (id == NO_ID || fresh || bits_get(&gnpwho, id)) {
+		id = id_new();
+		name_id_set(name, id);
+		fresh = 1;
+	} else
+		/* someone who stopped just before is still there (see
+		 * ivl_merge) */
+		merged = ivl_merge(&np_log, ts, id);
+
+	bits_set(&gwho, id);
+	bits_set(&gnpwho, id);
+	if (pflags & PF_DEBUG) {
+		who_graph_line(id, 4);
+		fputc('\n', stderr);
+		who_graph_line(id, 2);
+		gdebug(ts, id, "START");
+		line_finish(ev->rest, ev->end);
+	}
+
+	if (fresh || !ivl_merge(&p_log, ts, id))
+		ivl_start(&p_log, ts, id);
+	if (!merged)
+		ivl_start(&np_log, ts, id);
+}
+
+/******
+ * bills in two phases ("-2")
+ ******/
+
+/* What a PAY or a BUY adds to the debt only depends on who was there, and
+ * adding up debt can be done in any order. So with "-2", instead of working
+ * them out as they are read, we only write them down (pend_add), and the
+ * rest of the lines are applied as usual. Once all lines were read (or before
+ * saving a checkpoint), we work all of them out at once (pend_flush), split
+ * among "-j" threads, each adding up debt in a graph of its own. In the end,
+ * these graphs are added to the main one.
+ *
+ * A line that is written down remembers how many points the timeline had
+ * when it was read, and those points are frozen, so that it gets the same
+ * answer it would have gotten then (see tl_iter).
+ *
+ * With "-V", each of them is also applied as it is read, the usual way (see
+ * ev_run, so remembered billing periods and BUYs that are added up are used
+ * as without "-2"), in a separate graph, and we check that it's the same as
+ * what the threads got.
+ */
+
+#define PEND_BLOCK 256 // lines a thread takes at a time
+
+struct pend {
+	unsigned char op;
+	unsigned id; // payer
+	time_t min, max; // billing period (both the date, for a BUY)
+	int64_t value;
+	size_t lim; // points of the timeline it can look at
+};
+
+struct worker {
+	pthread_t thread;
+	struct ge ge;
+	struct net net;
+	struct acc acc;
+};
+
+struct pend *pend;
+size_t pend_n, pend_cap, pend_next;
+
+static inline struct timeline *
+pend_tl(unsigned op)
+{
+	return op == OP_PAY ? &p_log.tl : &np_log.tl;
+}
+
+static inline void
+pend_eval(struct pend *p, struct acc *a, struct ivl_cur *c)
+{
+	if (p->op == OP_PAY)
+		pay_eval(a, p->id, p->value, p->max - p->min, c, NULL);
+	else
+		buy_eval(a, p->id, p->value, c);
+}
+
+/* write down a PAY or BUY, to work it out later. Returns 0 if it has to be
+ * applied now (it's not one, or the timeline can't be used) */
+static int
+pend_add(struct ev *ev)
+{
+	struct timeline *tl = pend_tl(ev->op);
+	struct pend *p;
+
+	/* (with "-e prefix", a PAY is quick enough as it is) */
+	if ((ev->op != OP_PAY && ev->op != OP_BUY) || tl->unordered
+			|| (ev->op == OP_PAY && (ev->min > ev->max
+					|| prefix_ok(ev->min, ev->max))))
+		return 0;
+
+	if (pend_n >= pend_cap) {
+		pend_cap = pend_cap ? pend_cap * 2 : 1024;
+		pend = realloc(pend, pend_cap * sizeof(struct pend));
+		CBUG(!pend);
+	}
+
+	p = &pend[pend_n++];
+	p->op = ev->op;
+	p->id = name_id(ev->who);
+	p->min = ev->op == OP_PAY ? ev->min : ev->ts;
+	p->max = ev->op == OP_PAY ? ev->max : ev->ts;
+	p->value = ev->value;
+	p->lim = tl->frozen = tl->n;
+	return 1;
+}
+
+static void *
+pend_work(void *arg)
+{
+	struct worker *w = arg;
+	size_t i, end;
+
+	for (;;) {
+		i = __atomic_fetch_add(&pend_next, PEND_BLOCK, __ATOMIC_RELAXED);
+		if (i >= pend_n)
+			break;
+		end = i + PEND_BLOCK < pend_n ? i + PEND_BLOCK : pend_n;
+		for (; i < end; i++) {
+			struct ivl_cur c = tl_iter(pend_tl(pend[i].op),
+					pend[i].lim, pend[i].min, pend[i].max);
+			pend_eval(&pend[i], &w->acc, &c);
+		}
+	}
+
+	return NULL;
+}
+
+/* check that g (or nt, with "-n") has the same debt as vge (or vnet, with
+ * "-n"). If not, say where, and stop */
+static void
+pend_check(struct ge *g, struct net *nt)
+{
+	struct ge_cur c = ge_iter(g);
+	unsigned lo, hi, bad = 0;
+	int64_t value;
+
+	for (lo = 0; lo < nt->n || lo < vnet.n; lo++) {
+		int64_t x = lo < nt->n ? nt->v[lo] : 0,
+			y = lo < vnet.n ? vnet.v[lo] : 0;
+
+		if (x != y && bad++ < 10)
+			fprintf(stderr, "parity: %s: %lld, one at a time "
+					"%lld\n", id_str(lo), (long long) x,
+					(long long) y);
+	}
+
+	while (ge_next(g, &lo, &hi, &value, &c))
+		if (ge_get(&vge, lo, hi) != value && bad++ < 10)
+			fprintf(stderr, "parity: %s / %s: %lld, one at a time "
+					"%lld\n", id_str(lo), id_str(hi),
+					(long long) value,
+					(long long) ge_get(&vge, lo, hi));
+
+	c = ge_iter(&vge);
+	while (ge_next(&vge, &lo, &hi, &value, &c))
+		if (ge_get(g, lo, hi) != value && bad++ < 10)
+			fprintf(stderr, "parity: %s / %s: %lld, one at a time "
+					"%lld\n", id_str(lo), id_str(hi),
+					(long long) ge_get(g, lo, hi),
+					(long long) value);
+
+	if (bad) {
+		fprintf(stderr, "parity: failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stderr, "parity: ok (%zu PAY and BUY lines)\n", pend_n);
+}
+
+/* work out all PAY and BUY lines that were written down */
+static void
+pend_flush(void)
+{
+	struct worker *w;
+	struct ge sum, *dst = &ge;
+	struct net nsum, *ndst = &gnet;
+	unsigned n = jobs, i;
+
+	/* (with "-V", BUYs that were added up go into vge first) */
+	if (pflags & PF_PARITY)
+		fold_flush();
+
+	if (!pend_n)
+		return;
+
+	if (n > pend_n / PEND_BLOCK + 1)
+		n = pend_n / PEND_BLOCK + 1;
+
+	w = calloc(n, sizeof(struct worker));
+	CBUG(!w);
+	pend_next = 0;
+
+	for (i = 0; i < n; i++) {
+		w[i].acc.ge = &w[i].ge;
+		if (pflags & PF_NET)
+			w[i].acc.net = &w[i].net;
+	}
+
+	if (n == 1)
+		pend_work(w);
+	else {
+		for (i = 0; i < n; i++)
+			CBUG(pthread_create(&w[i].thread, NULL, pend_work,
+						&w[i]));
+		for (i = 0; i < n; i++)
+			pthread_join(w[i].thread, NULL);
+	}
+
+	if (pflags & PF_PARITY) {
+		memset(&sum, 0, sizeof(sum));
+		memset(&nsum, 0, sizeof(nsum));
+		dst = &sum;
+		ndst = &nsum;
+	}
+
+	for (i = 0; i < n; i++) {
+		ge_merge(dst, &w[i].ge);
+		ge_free(&w[i].ge);
+		net_merge(ndst, &w[i].net);
+		free(w[i].net.v);
+		acc_free(&w[i].acc);
+		seg_n += w[i].acc.seg_n;
+		edge_n += w[i].acc.edge_n;
+	}
+
+	if (pflags & PF_PARITY) {
+		pend_check(&sum, &nsum);
+		ge_merge(&ge, &sum);
+		ge_free(&sum);
+		ge_free(&vge);
+		net_merge(&gnet, &nsum);
+		free(nsum.v);
+		free(vnet.v);
+		memset(&vnet, 0, sizeof(vnet));
+	}
+
+	free(w);
+	pend_n = 0;
+	p_log.tl.frozen = np_log.tl.frozen = 0;
+}
+
+/* with "-m", a START or RESUME can change points of a timeline that are
+ * frozen (see ivl_merge). If so, the lines that were written down are worked
+ * out first, and then they are not frozen anymore */
+static void
+pend_unfreeze(struct ev *ev)
+{
+	struct ivlog *logs[] = { &p_log, &np_log };
+	unsigned id, k;
+	size_t i;
+
+	if (!pend_n || merge_tol < 0 || ev->who >= nid_n
+			|| (ev->op != OP_START && ev->op != OP_RESUME))
+		return;
+
+	id = nid[ev->who];
+	for (k = 0; k < 2 && id != NO_ID; k++) {
+		i = ivl_mergeable(logs[k], ev->ts, id);
+		if (i && tl_find(&logs[k]->tl, logs[k]->tl.n,
+					logs[k]->v[i - 1].max - 1)
+				< logs[k]->tl.frozen) {
+			pend_flush();
+			return;
+		}
+	}
+}
+
+/******
+ * instrumentation ("-T")
+ ******/
+
+/* With "-T", we measure how long each line takes to apply, and keep, for each
+ * TYPE of line, how many there were, how long they took in total, and how
+ * many took each amount of time (a histogram, where each bucket is for twice
+ * the time of the previous one). We also keep the slowest lines, and for each
+ * PAY, the number of segments (sections of the billing period with different
+ * people present) and of changes to the debt between two people it made.
+ * All of it is shown in stderr at the end.
+ */
+
+#define STAT_BUCKETS 40 // log2 of nanoseconds
+#define STAT_SLOW 10
+
+struct op_stat {
+	unsigned long count, hist[STAT_BUCKETS];
+	double total;
+};
+
+struct slow {
+	double t;
+	unsigned line;
+	unsigned char op;
+	unsigned long segs, edges;
+};
+
+struct op_stat op_stats[OP_MAX];
+struct slow slow[STAT_SLOW];
+unsigned slow_n = 0;
+unsigned long pay_segs[STAT_BUCKETS], pay_segs_max, pay_segs_sum,
+	 pay_edges_sum;
+
+static inline unsigned
+log2_bucket(unsigned long v)
+{
+	unsigned b = 0;
+
+	for (; v > 1 && b < STAT_BUCKETS - 1; v >>= 1)
+		b++;
+
+	return b;
+}
+
+/* apply an event, and measure it */
+static void
+stat_apply(struct ev *ev)
+{
+	struct op_stat *st = &op_stats[ev->op];
+	double t = clock_now();
+	unsigned i;
+
+	seg_n = edge_n = 0;
+	op_map[ev->op](ev);
+	t = clock_now() - t;
+
+	st->count++;
+	st->total += t;
+	st->hist[log2_bucket(t * 1e9)]++;
+
+	if (ev->op == OP_PAY) {
+		pay_segs[log2_bucket(seg_n)]++;
+		pay_segs_sum += seg_n;
+		pay_edges_sum += edge_n;
+		if (seg_n > pay_segs_max)
+			pay_segs_max = seg_n;
+	}
+
+	/* keep the slowest ones, slowest first */
+	if (slow_n == STAT_SLOW && t <= slow[STAT_SLOW - 1].t)
+		return;
+
+	if (slow_n < STAT_SLOW)
+		slow_n++;
+
+	for (i = slow_n - 1; i > 0 && slow[i - 1].t < t; i--)
+		slow[i] = slow[i - 1];
+
+	slow[i].t = t;
+	slow[i].line = ev->line;
+	slow[i].op = ev->op;
+	slow[i].segs = seg_n;
+	slow[i].edges = edge_n;
+}
+
+/* write a duration (in seconds) in a unit that makes it readable */
+static char *
+dur_str(char *buf, double t)
+{
+	if (t < 1e-6)
+		sprintf(buf, "%.0fns", t * 1e9);
+	else if (t < 1e-3)
+		sprintf(buf, "%.1fus", t * 1e6);
+	else if (t < 1)
+		sprintf(buf, "%.1fms", t * 1e3);
+	else
+		sprintf(buf, "%.2fs", t);
+
+	return buf;
+}
+
+static void
+stat_show(void)
+{
+	char a[16], b[16];
+	unsigned i, j;
+
+	for (i = 0; i < OP_MAX; i++) {
+		struct op_stat *st = &op_stats[i];
+
+		if (!st->count)
+			continue;
+
+		fprintf(stderr, "%-8s %10lu lines %10s total %10s avg\n",
+				op_names[i], st->count, dur_str(a, st->total),
+				dur_str(b, st->total / st->count));
+
+		for (j = 0; j < STAT_BUCKETS; j++)
+			if (st->hist[j])
+				fprintf(stderr, "    %8s - %-8s %10lu\n",
+						dur_str(a, (1UL << j) / 1e9),
+						dur_str(b, (2UL << j) / 1e9),
+						st->hist[j]);
+	}
+
+	if (merge_tol >= 0)
+		fprintf(stderr, "merged intervals: %lu\n", merge_n);
+
+	if (op_stats[OP_PAY].count) {
+		fprintf(stderr, "PAY segments: %lu (%.1f avg, %lu max), "
+				"edge updates: %lu\n", pay_segs_sum,
+				(double) pay_segs_sum / op_stats[OP_PAY].count,
+				pay_segs_max, pay_edges_sum);
+		for (j = 0; j < STAT_BUCKETS; j++)
+			if (pay_segs[j])
+				fprintf(stderr, "    %8lu - %-8lu %10lu\n",
+						j ? 1UL << j : 0,
+						(2UL << j) - 1, pay_segs[j]);
+	}
+
+	fprintf(stderr, "slowest lines:\n");
+	for (i = 0; i < slow_n; i++) {
+		fprintf(stderr, "    line %u %s %s", slow[i].line,
+				op_names[slow[i].op], dur_str(a, slow[i].t));
+		if (slow[i].op == OP_PAY)
+			fprintf(stderr, " (%lu segments, %lu edge updates)",
+					slow[i].segs, slow[i].edges);
+		fputc('\n', stderr);
+	}
+}
+
+/* apply an event now (see the op_* functions above) */
+static inline void
+ev_run(struct ev *ev)
+{
+	/* the BUYs that were added up are split among who is there now */
+	if (ev->op != OP_BUY && ev->op != OP_PAY && ev->op != OP_TRANSFER)
+		fold_flush();
+
+	if (pflags & PF_TWO_PHASE)
+		pend_unfreeze(ev);
+
+	if ((pflags & PF_TWO_PHASE) && pend_add(ev)) {
+		struct acc a = gacc;
+
+		if (!(pflags & PF_PARITY))
+			return;
+
+		/* with "-V", it is also applied the usual way now, but into
+		 * vge, to check against what the threads get (see
+		 * pend_check) */
+		gacc = vacc;
+		op_map[ev->op](ev);
+		vacc = gacc;
+		gacc = a;
+		return;
+	}
+
+	if (pflags & PF_TIMING)
+		stat_apply(ev);
+	else
+		op_map[ev->op](ev);
+}
+
+/******
+ * bills that wait for the end of their billing period
+ ******/
+
+/* A bill is often paid before its billing period ends (or even before it
+ * starts). Working it out then, whoever is there is taken to stay until the
+ * end, and if they leave (or go away for a while) before it, the bill
+ * wouldn't know. So such a PAY waits (park_add), in a heap with the one
+ * whose period ends first at the top, and is worked out when we read the
+ * first line that isn't before that end (park_release), or when there are no
+ * more lines (park_flush). By then, who was there in its period is known.
+ *
+ * Checkpoints keep the ones that are still waiting.
+ */
+
+struct park {
+	struct ev ev; // (without its comment)
+	unsigned id; // of the payer, when it was read
+};
+
+struct park *park;
+size_t park_n, park_cap;
+
+static inline int
+park_lt(struct park *a, struct park *b)
+{
+	return a->ev.max < b->ev.max
+		|| (a->ev.max == b->ev.max && a->ev.line < b->ev.line);
+}
+
+/* binary heap, the period that ends first at the top */
+static void
+park_push(struct park p)
+{
+	size_t i, up;
+
+	if (park_n >= park_cap) {
+		park_cap = park_cap ? park_cap * 2 : 64;
+		park = realloc(park, park_cap * sizeof(struct park));
+		CBUG(!park);
+	}
+
+	for (i = park_n++; i; i = up) {
+		up = (i - 1) / 2;
+		if (!park_lt(&p, &park[up]))
+			break;
+		park[i] = park[up];
+	}
+
+	park[i] = p;
+}
+
+static struct park
+park_pop(void)
+{
+	struct park top = park[0], last = park[--park_n];
+	size_t i = 0, child;
+
+	for (; (child = i * 2 + 1) < park_n; i = child) {
+		if (child + 1 < park_n && park_lt(&park[child + 1], &park[child]))
+			child++;
+		if (!park_lt(&park[child], &last))
+			break;
+		park[i] = park[child];
+	}
+
+	park[i] = last;
+	return top;
+}
+
+/* make a PAY wait, if its billing period ends after it. Returns 0 if it can
+ * be applied now */
+static int
+park_add(struct ev *ev)
+{
+	struct park p;
+
+	if (ev->op != OP_PAY || ev->max <= ev->ts || ev->min >= ev->max)
+		return 0;
+
+	p.ev = *ev;
+	p.ev.rest = p.ev.end = NULL;
+	p.id = name_id(ev->who);
 
-	read_word(username, &line, sizeof(username));
-	id = idm_new(&idm);
-	suhash_put(g_hd, username, id);
-	uhash_put(gwho_hd, id, &id, sizeof(id));
-	uhash_put(gnpwho_hd, id, &id, sizeof(id));
 	if (pflags & PF_DEBUG) {
-		who_graph_line(id, 4);
-		fputc('\n', stderr);
-		who_graph_line(id, 2);
-		gdebug(ts, id, "START");
-		line_finish(line);
+		char mins[DATE_MAX_LEN], maxs[DATE_MAX_LEN];
+		who_graph_line(p.id, 5);
+		printtime(mins, ev->min);
+		printtime(maxs, ev->max);
+		gdebug(ev->ts, p.id, "PAY");
+		fprintf(stderr, " %lld %s %s", (long long) ev->value, mins, maxs);
+		line_finish(ev->rest, ev->end);
+		who_graph_line(-1, 0);
+		fprintf(stderr, "  waits until %s\n", maxs);
+	}
+
+	park_push(p);
+	return 1;
+}
+
+/* the payer is whoever had the nickname when the line was read (if they
+ * left and started again since, that is not the same id) */
+static void
+park_run(struct park *p)
+{
+	unsigned id = nid[p->ev.who];
+
+	nid[p->ev.who] = p->id;
+	ev_run(&p->ev);
+	nid[p->ev.who] = id;
+}
+
+/* work out the PAYs whose billing period ends at or before ts */
+static inline void
+park_release(time_t ts)
+{
+	struct park p;
+
+	while (park_n && park[0].ev.max <= ts) {
+		p = park_pop();
+		park_run(&p);
+	}
+}
+
+/* work out all of them (there are no more lines) */
+static void
+park_flush(void)
+{
+	struct park p;
+
+	while (park_n) {
+		p = park_pop();
+		park_run(&p);
 	}
-	it_start(p_itd, ts, id);
-	it_start(np_itd, ts, id);
+
+	free(park);
+	park = NULL;
+	park_cap = 0;
+}
+
+/* With "-D", people come and go at the start of a day (or hour): the date of
+ * START, PAUSE, RESUME and STOP lines is rounded to the nearest one, so that
+ * bills are split in whole days */
+static inline void
+ev_quant(struct ev *ev)
+{
+	time_t r;
+
+	if (ev->op != OP_START && ev->op != OP_STOP && ev->op != OP_PAUSE
+			&& ev->op != OP_RESUME)
+		return;
+
+	r = ev->ts % quantum;
+	if (r < 0)
+		r += quantum;
+	ev->ts += r * 2 >= quantum ? quantum - r : -r;
+}
+
+/* apply an event, or make it wait (see park_add) */
+static inline void
+ev_apply(struct ev *ev)
+{
+	if (quantum)
+		ev_quant(ev);
+	park_release(ev->ts);
+	if (!park_add(ev))
+		ev_run(ev);
 }
 
 /******
@@ -607,44 +2026,786 @@ void op_start(time_t ts, char *line) {
  * if it starts with a "#", in other words, if it is totally commented out.
  * If it is, it ignores this line. If it isn't, it then proceeds to read a
  * word: the TYPE of operation or event that the line represents. It also reads
- * the DATE. After this, it checks what the TYPE of operation is. Depending on
+ * the DATE, and the rest of what that TYPE of line has (see ev_parse in
+ * common.h). After this, it checks what the TYPE of operation is. Depending on
  * that, it does different things. In all valid cases (and for every different
- * TYPE), it calls a function named process_<TYPE> (lowercase), all of these
- * functions receive the DATE that was read, and also a pointer to the part of
- * the line that wasn't read yet.
+ * TYPE), it calls a function named op_<TYPE> (lowercase), all of these
+ * functions receive what was read from the line (an event).
  *
  * Check out the functions in the section above to understand how these work
  * internally.
  */
 
 static void
-line_proc(char *line)
+line_proc(char *line, char *end)
 {
-	char op_str[9], date_str[DATE_MAX_LEN];
-	time_t ts;
+	struct ev ev;
+	int ret;
 
-	if (line[0] == '#' || line[0] == '\n')
+	line_n++;
+	ret = ev_parse(&ev, &names, line, end);
+	ev.line = line_n;
+	if (!ret)
 		return;
+	if (ret < 0)
+		ev_fail(&ev);
+
+	ev_apply(&ev);
+}
+
+/******
+ * parsing in parallel
+ ******/
+
+/* Reading the lines is independent from line to line, but applying them is
+ * not, they have to be applied in order. So for big inputs, we split them
+ * into chunks (at line boundaries), and have a thread parse each chunk into
+ * events. Then we apply all events in order, here in the main thread.
+ *
+ * Each thread interns nicknames in its own table (so they don't have to take
+ * turns using the same one). When a thread is done, it waits for the threads
+ * of the previous chunks to add their nicknames to the global table, adds
+ * its own, and then it translates the numbers in its events to the global
+ * ones. The line numbers are made global in the same way. Applying a START
+ * can add nicknames to the global table too (see op_start), so we only
+ * start applying once all threads are done.
+ */
+
+#define CHUNK_MIN (1 << 18)
+
+struct chunk {
+	pthread_t thread;
+	unsigned idx, lines;
+	char *start, *end;
+	struct names nm;
+	struct ev *ev;
+	size_t n, cap;
+};
+
+static pthread_mutex_t merge_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merge_cond = PTHREAD_COND_INITIALIZER;
+static unsigned merge_next; // the chunk whose turn it is to merge
+
+static void *
+chunk_parse(void *arg)
+{
+	struct chunk *ch = arg;
+	char *line, *nl;
+	unsigned *xl, i, base;
+	struct ev *ev;
+	int ret;
+
+	ch->cap = (ch->end - ch->start) / 32 + 1;
+	ch->ev = malloc(ch->cap * sizeof(struct ev));
+	CBUG(!ch->ev);
+
+	for (line = ch->start; line < ch->end; line = nl) {
+		nl = memchr(line, '\n', ch->end - line);
+		nl = nl ? nl + 1 : ch->end;
+		ch->lines++;
+
+		if (ch->n >= ch->cap) {
+			ch->cap *= 2;
+			ch->ev = realloc(ch->ev, ch->cap * sizeof(struct ev));
+			CBUG(!ch->ev);
+		}
+
+		ev = &ch->ev[ch->n];
+		ret = ev_parse(ev, &ch->nm, line, nl);
+		if (!ret)
+			continue;
+
+		ev->line = ch->lines;
+		ch->n++;
+
+		/* it is reported when its turn comes (see buf_proc) */
+		if (ret < 0)
+			break;
+	}
+
+	xl = malloc((ch->nm.n + 1) * sizeof(unsigned));
+	CBUG(!xl);
+
+	pthread_mutex_lock(&merge_mtx);
+	while (merge_next != ch->idx)
+		pthread_cond_wait(&merge_cond, &merge_mtx);
 
-	read_word(op_str, &line, sizeof(op_str));
-	op_proc_t *cb;
+	for (i = 0; i < ch->nm.n; i++) {
+		char *s = names_str(&ch->nm, i);
+		xl[i] = names_get(&names, s, strlen(s));
+	}
+
+	base = line_n;
+	line_n += ch->lines;
+	merge_next++;
+	pthread_cond_broadcast(&merge_cond);
+	pthread_mutex_unlock(&merge_mtx);
+
+	for (ev = ch->ev; ev < ch->ev + ch->n; ev++) {
+		ev->who = xl[ev->who];
+		if (ev->op == OP_TRANSFER)
+			ev->who2 = xl[ev->who2];
+		ev->line += base;
+	}
+
+	free(xl);
+	names_free(&ch->nm);
+	return NULL;
+}
 
-	if (shash_get(op_hd, &cb, op_str) < 0)
+/* process all lines in a buffer. Each line goes from its first character to
+ * (and including) its '\n', the buffer doesn't need to be NUL terminated. */
+static void
+buf_proc(char *buf, size_t len)
+{
+	char *end = buf + len, *line, *nl;
+	struct chunk *chunks;
+	unsigned n = len / CHUNK_MIN, i;
+	size_t j;
+
+	if (n > jobs)
+		n = jobs;
+
+	if (n <= 1) {
+		for (line = buf; line < end; line = nl) {
+			nl = memchr(line, '\n', end - line);
+			nl = nl ? nl + 1 : end;
+			line_proc(line, nl);
+		}
 		return;
+	}
+
+	chunks = calloc(n, sizeof(struct chunk));
+	CBUG(!chunks);
+	merge_next = 0;
+
+	for (i = 0, line = buf; i < n; i++) {
+		chunks[i].idx = i;
+		chunks[i].start = line;
+		if (i == n - 1)
+			nl = end;
+		else {
+			nl = memchr(buf + len / n * (i + 1), '\n',
+					end - buf - len / n * (i + 1));
+			nl = nl ? nl + 1 : end;
+			if (nl < line)
+				nl = line;
+		}
+		chunks[i].end = line = nl;
+		CBUG(pthread_create(&chunks[i].thread, NULL, chunk_parse,
+					&chunks[i]));
+	}
+
+	for (i = 0; i < n; i++)
+		pthread_join(chunks[i].thread, NULL);
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < chunks[i].n; j++) {
+			if (chunks[i].ev[j].err)
+				ev_fail(&chunks[i].ev[j]);
+			ev_apply(&chunks[i].ev[j]);
+		}
+		free(chunks[i].ev);
+	}
+
+	free(chunks);
+}
+
+/******
+ * compiled ledgers
+ ******/
+
+/* Files written by sem-compile already have the events, so instead of
+ * parsing text we only have to decode them (the format is described at the
+ * top of sem-compile.c). */
+
+static void
+bin_fail(char *path, char *what, unsigned block)
+{
+	fprintf(stderr, "%s: %s (block %u)\n", path, what, block);
+	exit(EXIT_FAILURE);
+}
+
+/* decode the n events of a block, with its columns in col */
+static int
+bin_block_get(struct ev *ev, size_t n, struct rbuf *col, unsigned *xl,
+		unsigned names_n)
+{
+	unsigned char op;
+	unsigned line = 0;
+	time_t ts = 0;
+	uint64_t v;
+
+	for (; n; n--, ev++) {
+		if (rb_get(&col[BC_OP], &op, 1) || op >= OP_MAX)
+			return -1;
+		ev->op = op;
+
+		if (varint_get(&col[BC_LINE], &v))
+			return -1;
+		ev->line = line += v;
+
+		if (varint_get(&col[BC_TS], &v))
+			return -1;
+		ev->ts = ts += unzigzag(v);
+
+		if (varint_get(&col[BC_WHO], &v) || v >= names_n)
+			return -1;
+		ev->who = xl[v];
+		ev->rest = ev->end = NULL;
+
+		switch (op) {
+		case OP_TRANSFER:
+			if (varint_get(&col[BC_WHO2], &v) || v >= names_n)
+				return -1;
+			ev->who2 = xl[v];
+			if (varint_get(&col[BC_VALUE], &v))
+				return -1;
+			ev->value = unzigzag(v);
+			break;
+		case OP_PAY:
+			if (varint_get(&col[BC_VALUE], &v))
+				return -1;
+			ev->value = unzigzag(v);
+			if (varint_get(&col[BC_MIN], &v))
+				return -1;
+			ev->min = ev->ts + unzigzag(v);
+			if (varint_get(&col[BC_MAX], &v))
+				return -1;
+			ev->max = ev->min + unzigzag(v);
+			break;
+		case OP_BUY:
+			if (varint_get(&col[BC_VALUE], &v))
+				return -1;
+			ev->value = unzigzag(v);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* apply all events of a compiled ledger */
+static void
+bin_proc(char *path, char *buf, size_t len)
+{
+	struct rbuf rb = { buf, buf + len }, col[BC_MAX_COL];
+	struct bin_hdr hdr;
+	struct ev *ev;
+	unsigned *xl, block = 0;
+	uint32_t n, size, i, dn;
+	uint64_t h;
+	uint8_t nlen;
+	char *p;
+
+	if (rb_get(&rb, &hdr, sizeof(hdr))
+			|| memcmp(hdr.magic, BIN_MAGIC, sizeof(BIN_MAGIC)))
+		bin_fail(path, "not a compiled ledger", block);
+
+	if (hdr.version != BIN_VERSION)
+		bin_fail(path, "unsupported version", block);
+
+	/* nicknames, which we intern in the order they were compiled */
+	p = rb.p;
+	if (rb_get(&rb, &dn, sizeof(dn)))
+		bin_fail(path, "truncated", block);
+
+	xl = malloc((dn + 1) * sizeof(unsigned));
+	CBUG(!xl);
+	for (i = 0; i < dn; i++) {
+		if (rb_get(&rb, &nlen, sizeof(nlen))
+				|| (size_t) (rb.end - rb.p) < nlen)
+			bin_fail(path, "truncated", block);
+		xl[i] = names_get(&names, rb.p, nlen);
+		rb.p += nlen;
+	}
+
+	if (rb_get(&rb, &h, sizeof(h)) || h != hash64(p, rb.p - p - sizeof(h), 0))
+		bin_fail(path, "corrupt nicknames", block);
+
+	ev = malloc(hdr.block * sizeof(struct ev));
+	CBUG(!ev);
+
+	for (;; block++) {
+		if (rb_get(&rb, &n, sizeof(n)) || rb_get(&rb, &size, sizeof(size)))
+			bin_fail(path, "truncated", block);
+
+		if (!n)
+			break;
+
+		if (n > hdr.block || (size_t) (rb.end - rb.p) < size + sizeof(h))
+			bin_fail(path, "truncated", block);
+
+		memcpy(&h, rb.p + size, sizeof(h));
+		if (h != hash64(rb.p, size, 0))
+			bin_fail(path, "checksum mismatch", block);
+
+		for (i = 0; i < BC_MAX_COL; i++) {
+			uint32_t csize;
+
+			if (rb_get(&rb, &csize, sizeof(csize))
+					|| (size_t) (rb.end - rb.p) < csize)
+				bin_fail(path, "corrupt block", block);
+			col[i].p = rb.p;
+			col[i].end = rb.p += csize;
+		}
+		rb.p += sizeof(h);
+
+		if (bin_block_get(ev, n, col, xl, dn))
+			bin_fail(path, "corrupt block", block);
+
+		for (i = 0; i < n; i++)
+			ev_apply(&ev[i]);
+
+		line_n = ev[n - 1].line;
+	}
+
+	free(ev);
+	free(xl);
+}
+
+/******
+ * checkpoints
+ ******/
+
+/* A checkpoint is a file with everything we know after processing the
+ * beginning of the input, up to a certain byte offset. Along with that offset
+ * it stores a hash of those bytes, so that we can tell if they were changed.
+ * If they weren't, we can load what we knew instead of processing all of
+ * those lines again, and only process the ones that were appended since.
+ *
+ * It is made of a header (which also has how many lines the offset is, and
+ * the options that change what is kept) followed by these sections (host
+ * byte order):
+ *
+ * ids: how many were generated, then (id, length, nickname) for each id
+ * edges: (id, id, debt) for each edge of the graph, or with the CKPT_NET
+ *        flag, (id, balance) for each id that has one
+ * who: ids of people present, then ids of people renting
+ * intervals: (id, min, max) for each interval of BST A, then of BST B
+ * waiting: how many PAYs are waiting (see park_add), then (payer id, line,
+ *          date, min, max, amount) for each
+ *
+ * And finally a hash of all of that, to detect truncated or corrupt files.
+ */
+
+#define CKPT_MAGIC "SEMCKPT"
+#define CKPT_VERSION 6
+#define CKPT_NET 1 // flag: balances instead of edges ("-n")
+#define CKPT_PREFIX 2 // flag: bills were split with "-e prefix"
+
+/* the flags that the options we were given make */
+static inline uint32_t
+ckpt_flags(void)
+{
+	return (pflags & PF_NET ? CKPT_NET : 0)
+		| (pflags & PF_PREFIX ? CKPT_PREFIX : 0);
+}
+
+struct ckpt_hdr {
+	char magic[8];
+	uint32_t version, flags;
+	uint64_t offset, prefix_hash, lines;
+	int64_t merge_tol; // "-m"
+	int64_t quantum; // "-D"
+};
+
+static void
+ckpt_put_who(struct wbuf *wb, struct bits *who)
+{
+	size_t at = wb->n;
+	uint32_t n = 0;
+	unsigned id;
+
+	wb_put(wb, &n, sizeof(n));
+	for (id = 0; bits_next(who, &id); id++, n++)
+		wb_put(wb, &id, sizeof(id));
+	memcpy(wb->p + at, &n, sizeof(n));
+}
+
+static void
+ckpt_put_ivlog(struct wbuf *wb, struct ivlog *log)
+{
+	uint64_t n = log->n;
+	int64_t min, max;
+
+	wb_put(wb, &n, sizeof(n));
+	for (size_t i = 0; i < log->n; i++) {
+		min = log->v[i].min;
+		max = log->v[i].max;
+		wb_put(wb, &log->v[i].id, sizeof(unsigned));
+		wb_put(wb, &min, sizeof(min));
+		wb_put(wb, &max, sizeof(max));
+	}
+}
+
+/* save what we know, which corresponds to the first "offset" bytes of buf */
+static void
+ckpt_save(char *path, char *buf, size_t offset)
+{
+	struct wbuf wb = { NULL, 0, 0 };
+	struct ckpt_hdr hdr;
+	struct ge_cur gc;
+	char *name, *tmp;
+	unsigned ids[2], i;
+	uint32_t n = 0;
+	size_t at;
+	int64_t value;
+	uint64_t h;
+	uint8_t len;
+	FILE *fp;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CKPT_MAGIC, sizeof(CKPT_MAGIC));
+	hdr.version = CKPT_VERSION;
+	hdr.flags = ckpt_flags();
+	hdr.offset = offset;
+	hdr.prefix_hash = hash64(buf, offset, 0);
+	hdr.lines = line_n;
+	hdr.merge_tol = merge_tol;
+	hdr.quantum = quantum;
+	wb_put(&wb, &hdr, sizeof(hdr));
+
+	/* every id, in order, so that loading them gives each nickname its
+	 * latest id (see name_id_set) */
+	wb_put(&wb, &idm_n, sizeof(idm_n));
+	at = wb.n;
+	wb_put(&wb, &n, sizeof(n));
+	for (i = 0; i < idm_n; i++) {
+		if (i >= id_name_n || id_name[i] == NO_ID)
+			continue;
+		name = id_str(i);
+		len = strlen(name);
+		wb_put(&wb, &i, sizeof(unsigned));
+		wb_put(&wb, &len, sizeof(len));
+		wb_put(&wb, name, len);
+		n++;
+	}
+	memcpy(wb.p + at, &n, sizeof(n));
+
+	n = 0;
+	at = wb.n;
+	wb_put(&wb, &n, sizeof(n));
+	gc = ge_iter(&ge);
+	for (; ge_next(&ge, &ids[0], &ids[1], &value, &gc); n++) {
+		wb_put(&wb, ids, sizeof(ids));
+		wb_put(&wb, &value, sizeof(value));
+	}
+	for (i = 0; i < gnet.n; i++) {
+		if (!gnet.v[i])
+			continue;
+		wb_put(&wb, &i, sizeof(i));
+		wb_put(&wb, &gnet.v[i], sizeof(int64_t));
+		n++;
+	}
+	memcpy(wb.p + at, &n, sizeof(n));
+
+	ckpt_put_who(&wb, &gwho);
+	ckpt_put_who(&wb, &gnpwho);
+	ckpt_put_ivlog(&wb, &p_log);
+	ckpt_put_ivlog(&wb, &np_log);
+
+	n = park_n;
+	wb_put(&wb, &n, sizeof(n));
+	for (i = 0; i < park_n; i++) {
+		struct ev *ev = &park[i].ev;
+
+		wb_put(&wb, &park[i].id, sizeof(unsigned));
+		wb_put(&wb, &ev->line, sizeof(ev->line));
+		wb_put(&wb, &ev->ts, sizeof(ev->ts));
+		wb_put(&wb, &ev->min, sizeof(ev->min));
+		wb_put(&wb, &ev->max, sizeof(ev->max));
+		wb_put(&wb, &ev->value, sizeof(ev->value));
+	}
+
+	h = hash64(wb.p, wb.n, 0);
+	wb_put(&wb, &h, sizeof(h));
+
+	/* write to a temporary file first, so that if we are interrupted, the
+	 * previous checkpoint is still there and intact */
+	tmp = malloc(strlen(path) + sizeof(".tmp"));
+	CBUG(!tmp);
+	sprintf(tmp, "%s.tmp", path);
+
+	fp = fopen(tmp, "wb");
+	if (!fp || fwrite(wb.p, 1, wb.n, fp) != wb.n || fclose(fp)
+			|| rename(tmp, path))
+		perror(tmp);
+
+	free(tmp);
+	free(wb.p);
+}
+
+/* go through the sections of a checkpoint (after its header) without
+ * loading anything, to make sure that none of them is cut short, and that
+ * nothing comes after them. Returns -1 if that's not the case */
+static int
+ckpt_check(struct rbuf rb, int net)
+{
+	uint64_t n64;
+	uint32_t n;
+	unsigned count;
+	uint8_t nlen;
+	int i;
+
+	if (rb_get(&rb, &count, sizeof(count)) || rb_get(&rb, &n, sizeof(n)))
+		return -1;
+	for (; n; n--)
+		if (rb_skip(&rb, 1, sizeof(unsigned))
+				|| rb_get(&rb, &nlen, sizeof(nlen))
+				|| nlen >= USERNAME_MAX_LEN
+				|| rb_skip(&rb, nlen, 1))
+			return -1;
+
+	if (rb_get(&rb, &n, sizeof(n)) || rb_skip(&rb, n, net
+				? sizeof(unsigned) + sizeof(int64_t)
+				: 2 * sizeof(unsigned) + sizeof(int64_t)))
+		return -1;
+
+	for (i = 0; i < 2; i++)
+		if (rb_get(&rb, &n, sizeof(n))
+				|| rb_skip(&rb, n, sizeof(unsigned)))
+			return -1;
+
+	for (i = 0; i < 2; i++)
+		if (rb_get(&rb, &n64, sizeof(n64)) || rb_skip(&rb, n64,
+					sizeof(unsigned) + 2 * sizeof(int64_t)))
+			return -1;
+
+	/* parked PAYs: payer, line, ts, min, max and value */
+	if (rb_get(&rb, &n, sizeof(n)) || rb_skip(&rb, n, 2 * sizeof(unsigned)
+				+ 3 * sizeof(time_t) + sizeof(int64_t)))
+		return -1;
+
+	return rb.p == rb.end ? 0 : -1;
+}
+
+static void
+ckpt_get_who(struct rbuf *rb, struct bits *who)
+{
+	uint32_t n = 0;
+	unsigned id = 0;
+
+	CBUG(rb_get(rb, &n, sizeof(n)));
+	for (; n; n--) {
+		CBUG(rb_get(rb, &id, sizeof(id)));
+		bits_set(who, id);
+	}
+}
+
+static void
+ckpt_get_ivlog(struct rbuf *rb, struct ivlog *log)
+{
+	uint64_t n = 0;
+	int64_t min = 0, max = 0;
+	unsigned id = 0;
+
+	CBUG(rb_get(rb, &n, sizeof(n)));
+	for (; n; n--) {
+		CBUG(rb_get(rb, &id, sizeof(id)));
+		CBUG(rb_get(rb, &min, sizeof(min)));
+		CBUG(rb_get(rb, &max, sizeof(max)));
+		ivl_start(log, min, id);
+		if (max != TS_OPEN)
+			ivl_stop(log, max, id);
+	}
+	tl_rebuild(log);
+}
+
+/* Load a checkpoint, if there is one that matches the beginning of buf.
+ * Returns the number of bytes of buf that it corresponds to, so the caller
+ * knows where to resume from (0 if nothing was loaded). */
+static size_t
+ckpt_load(char *path, char *buf, size_t len)
+{
+	struct ckpt_hdr hdr;
+	struct rbuf rb;
+	char name[USERNAME_MAX_LEN], *cbuf;
+	unsigned ids[2] = { 0, 0 }, id = 0, count = 0;
+	uint32_t n = 0;
+	size_t clen;
+	int64_t value = 0;
+	uint64_t h;
+	uint8_t nlen = 0;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return 0;
+
+	cbuf = slurp(fp, &clen);
+	fclose(fp);
+
+	if (clen < sizeof(hdr) + sizeof(h))
+		goto mismatch;
+
+	clen -= sizeof(h);
+	memcpy(&h, cbuf + clen, sizeof(h));
+	memcpy(&hdr, cbuf, sizeof(hdr));
+
+	if (h != hash64(cbuf, clen, 0)
+			|| memcmp(hdr.magic, CKPT_MAGIC, sizeof(CKPT_MAGIC))
+			|| hdr.version != CKPT_VERSION
+			|| hdr.flags != ckpt_flags()
+			|| hdr.merge_tol != merge_tol
+			|| hdr.quantum != quantum
+			|| hdr.offset > len
+			|| hdr.prefix_hash != hash64(buf, hdr.offset, 0))
+		goto mismatch;
+
+	/* so that if a section is cut short, we find out before anything
+	 * is loaded, and can still process everything instead */
+	rb.p = cbuf + sizeof(hdr);
+	rb.end = cbuf + clen;
+	if (ckpt_check(rb, hdr.flags & CKPT_NET))
+		goto mismatch;
+
+	line_n = hdr.lines;
+
+	CBUG(rb_get(&rb, &count, sizeof(count)));
+	for (; idm_n < count; id_new());
+
+	CBUG(rb_get(&rb, &n, sizeof(n)));
+	for (; n; n--) {
+		CBUG(rb_get(&rb, &id, sizeof(id)));
+		CBUG(rb_get(&rb, &nlen, sizeof(nlen)));
+		CBUG(nlen >= sizeof(name) || rb_get(&rb, name, nlen));
+		name_id_set(names_get(&names, name, nlen), id);
+	}
+
+	CBUG(rb_get(&rb, &n, sizeof(n)));
+	for (; n; n--) {
+		if (hdr.flags & CKPT_NET) {
+			CBUG(rb_get(&rb, &id, sizeof(id)));
+			CBUG(rb_get(&rb, &value, sizeof(value)));
+			net_grow(&gnet, id);
+			gnet.v[id] = value;
+			continue;
+		}
+		CBUG(rb_get(&rb, ids, sizeof(ids)));
+		CBUG(rb_get(&rb, &value, sizeof(value)));
+		ge_add(&ge, ids[0], ids[1], value);
+	}
+
+	ckpt_get_who(&rb, &gwho);
+	ckpt_get_who(&rb, &gnpwho);
+	ckpt_get_ivlog(&rb, &p_log);
+	ckpt_get_ivlog(&rb, &np_log);
+
+	CBUG(rb_get(&rb, &n, sizeof(n)));
+	for (; n; n--) {
+		struct park p;
+
+		memset(&p, 0, sizeof(p));
+		p.ev.op = OP_PAY;
+		CBUG(rb_get(&rb, &p.id, sizeof(p.id)));
+		CBUG(rb_get(&rb, &p.ev.line, sizeof(p.ev.line)));
+		CBUG(rb_get(&rb, &p.ev.ts, sizeof(p.ev.ts)));
+		CBUG(rb_get(&rb, &p.ev.min, sizeof(p.ev.min)));
+		CBUG(rb_get(&rb, &p.ev.max, sizeof(p.ev.max)));
+		CBUG(rb_get(&rb, &p.ev.value, sizeof(p.ev.value)));
+		CBUG(p.id >= id_name_n || id_name[p.id] == NO_ID);
+		p.ev.who = id_name[p.id];
+		park_push(p);
+	}
+
+	free(cbuf);
+	return hdr.offset;
+
+mismatch:
+	fprintf(stderr, "%s: checkpoint does not match the input (or "
+			"options), processing everything\n", path);
+	free(cbuf);
+	return 0;
+}
 
-	ts = read_ts(&line);
+/* map a whole file into memory, read only. Returns NULL if it is empty */
+static char *
+map_file(char *path, size_t *len)
+{
+	struct stat st;
+	char *buf;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	*len = st.st_size;
+	if (!*len) {
+		close(fd);
+		return NULL;
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	buf = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (buf == MAP_FAILED) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* we go through it once, from start to end */
+	madvise(buf, *len, MADV_SEQUENTIAL);
+	madvise(buf, *len, MADV_WILLNEED);
+	return buf;
+}
+
+/* add the time since the last call to a phase */
+static inline void
+phase_mark(enum phase ph)
+{
+	double t = clock_now();
+
+	phase_t[ph] += t - phase_last;
+	phase_last = t;
+}
 
-	cb(ts, line);
+/* one line per phase, in seconds, for sem-bench to read */
+static void
+phase_show(void)
+{
+	for (int i = 0; i < PH_MAX; i++)
+		fprintf(stderr, "phase %s %.6f\n", phase_names[i], phase_t[i]);
 }
 
 static inline void
 usage(char *prog)
 {
-	fprintf(stderr, "Usage: %s [-dpq]", prog);
+	fprintf(stderr, "Usage: %s [-2dnpPqsSTV] [-c checkpoint] [-f file] [-j jobs]"
+			" [-b compiled] [-e engine] [-m secs]"
+			" [-D unit]\n", prog);
 	fprintf(stderr, "    Options:\n");
+	fprintf(stderr, "        -2        work out bills after reading, "
+			"in parallel.\n");
+	fprintf(stderr, "        -b file   read a ledger compiled with "
+			"sem-compile.\n");
+	fprintf(stderr, "        -c file   load and save a checkpoint.\n");
 	fprintf(stderr, "        -d        display debug messages.\n");
+	fprintf(stderr, "        -D unit   people come and go at the nearest "
+			"day or hour.\n");
+	fprintf(stderr, "        -e engine how bills are split: segment "
+			"(default) or prefix.\n");
+	fprintf(stderr, "        -f file   read file instead of stdin.\n");
+	fprintf(stderr, "        -j jobs   threads parsing the input "
+			"(default: number of cpus).\n");
+	fprintf(stderr, "        -m secs   merge someone's intervals that "
+			"are this close.\n");
+	fprintf(stderr, "        -n        keep only what each person owes or "
+			"is owed in all.\n");
 	fprintf(stderr, "        -p        display who's present.\n");
+	fprintf(stderr, "        -P        show how long each phase took.\n");
 	fprintf(stderr, "        -q        validate only.\n");
+	fprintf(stderr, "        -s        show who pays whom to settle.\n");
+	fprintf(stderr, "        -S        same, as TRANSFER lines.\n");
+	fprintf(stderr, "        -T        show how long each type of line "
+			"took.\n");
+	fprintf(stderr, "        -V        same as -2, and check it against "
+			"the usual way.\n");
 }
 
 /* The main function is the entry point to the application. In this case, it
@@ -659,31 +2820,118 @@ usage(char *prog)
  * argument (a pointer). Look at process_line right above this comment to
  * understand how it works.
  *
+ * Or, with "-f file.txt", the file is mapped into memory and its lines are
+ * processed right where they are, without reading them into a buffer first.
+ * With "-b file.sem", the file is one made by sem-compile, which has the
+ * lines already parsed (see bin_proc).
+ *
+ * If a checkpoint file is given, the whole input is read first, and the lines
+ * the checkpoint already accounts for are skipped (see ckpt_load). The input
+ * is also read all at once if more than one thread to parse it with was
+ * asked for with "-j" (see buf_proc), or else it is read line by line, so
+ * that "-d" shows each line as soon as it comes in.
+ *
  * After reading each line in standard input, the program shows the debt
- * that was calculated, that is owed between the people (ge_show_all).
+ * that was calculated, that is owed between the people (ge_show_all). Or,
+ * with "-s", the transfers that would settle it (settle).
  */
 int
 main(int argc, char *argv[])
 {
-	char *line = NULL;
+	char *line = NULL, *ckpt_path = NULL, *in_path = NULL, *bin_path = NULL;
 	ssize_t linelen;
 	size_t linesize;
-	int ret;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int jobs_given = 0;
 	char c;
 
-	while ((c = getopt(argc, argv, "dpq")) != -1) {
+	jobs = ncpu > 0 ? ncpu : 1;
+	phase_last = clock_now();
+
+	while ((c = getopt(argc, argv, "2b:c:dD:e:f:j:m:npPqsSTV")) != -1) {
 		switch (c) {
+		case '2':
+			pflags |= PF_TWO_PHASE;
+			break;
+
+		case 'b':
+			bin_path = optarg;
+			break;
+
+		case 'c':
+			ckpt_path = optarg;
+			break;
+
 		case 'd':
 			pflags |= PF_DEBUG;
 			break;
 
+		case 'D':
+			if (!strcmp(optarg, "day"))
+				quantum = 86400;
+			else if (!strcmp(optarg, "hour"))
+				quantum = 3600;
+			else {
+				usage(*argv);
+				return 1;
+			}
+			break;
+
+		case 'e':
+			if (!strcmp(optarg, "prefix"))
+				pflags |= PF_PREFIX;
+			else if (strcmp(optarg, "segment")) {
+				usage(*argv);
+				return 1;
+			}
+			break;
+
+		case 'f':
+			in_path = optarg;
+			break;
+
+		case 'j':
+			jobs = strtoul(optarg, NULL, 10);
+			if (!jobs)
+				jobs = 1;
+			jobs_given = 1;
+			break;
+
+		case 'm':
+			merge_tol = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			pflags |= PF_NET;
+			break;
+
 		case 'p':
 			pflags |= PF_PRESENT;
 			break;
 
+		case 'P':
+			pflags |= PF_PHASES;
+			break;
+
 		case 'q':
 			pflags |= PF_QUIET;
 			break;
+
+		case 's':
+			pflags |= PF_SETTLE;
+			break;
+
+		case 'S':
+			pflags |= PF_SETTLE | PF_SETTLE_LINES;
+			break;
+
+		case 'T':
+			pflags |= PF_TIMING;
+			break;
+
+		case 'V':
+			pflags |= PF_TWO_PHASE | PF_PARITY;
+			break;
 			
 		default:
 			usage(*argv);
@@ -695,37 +2943,99 @@ main(int argc, char *argv[])
 		}
 	}
 
-	op_hd = hash_init();
+	/* these show each line as it is applied */
+	if (pflags & (PF_DEBUG | PF_TIMING))
+		pflags &= ~(PF_TWO_PHASE | PF_PARITY);
 
-	g_hd = hash_init();
-	ig_hd = hash_init();
-	ge_hd = hash_init();
-	gwho_hd = hash_init();
-	gnpwho_hd = hash_init();
-	hash_assoc(ig_hd, g_hd, ig_assoc);
+	if (pflags & PF_NET) {
+		gacc.net = &gnet;
+		vacc.net = &vnet;
+	}
 
+#ifdef USE_LIBIT
 	p_itd = it_init(NULL);
 	np_itd = it_init(NULL);
+	p_log.itd = p_itd;
+	np_log.itd = np_itd;
+#endif
+
+	if (bin_path) {
+		/* checkpoints are for text input */
+		if (ckpt_path || in_path) {
+			usage(*argv);
+			return 1;
+		}
 
-	gwho_hd = hash_init();
-	gnpwho_hd = hash_init();
+		size_t len;
+		char *buf = map_file(bin_path, &len);
+
+		phase_mark(PH_READ);
+		bin_proc(bin_path, buf, len);
+		if (buf)
+			munmap(buf, len);
+	} else if (in_path || ckpt_path || (jobs_given && jobs > 1)) {
+		size_t len, offset = 0, cut = 0;
+		char *buf = in_path ? map_file(in_path, &len)
+			: slurp(stdin, &len);
+
+		/* only lines that are complete go into the checkpoint, so we
+		 * process the unfinished last line (if any) after saving */
+		if (ckpt_path) {
+			offset = ckpt_load(ckpt_path, buf, len);
+			for (cut = len; cut > offset && buf[cut - 1] != '\n';
+					cut--);
+			phase_mark(PH_READ);
+			buf_proc(buf + offset, cut - offset);
+			pend_flush();
+			fold_flush();
+			phase_mark(PH_PROC);
+			if (cut > offset)
+				ckpt_save(ckpt_path, buf, cut);
+			phase_mark(PH_SAVE);
+		} else
+			phase_mark(PH_READ);
+
+		buf_proc(buf + cut, len - cut);
+
+		if (!in_path)
+			free(buf);
+		else if (buf)
+			munmap(buf, len);
+	} else {
+		while ((linelen = getline(&line, &linesize, stdin)) >= 0)
+			line_proc(line, line + linelen);
 
-	for (int i = 0; i < 7; i++)
-		shash_put(op_hd, op_map[i].name,
-				&op_map[i].cb, sizeof(op_map[i].cb));
+		free(line);
+	}
 
-	while ((linelen = getline(&line, &linesize, stdin)) >= 0)
-		line_proc(line);
+	park_flush();
+	pend_flush();
+	fold_flush();
 
-	free(line);
+	/* reading line by line, reading is part of processing */
+	phase_mark(PH_PROC);
 
 	if (pflags & PF_QUIET)
-		return EXIT_SUCCESS;
-
-	if (pflags & PF_PRESENT)
+		/* nothing to show */;
+	else if (pflags & PF_PRESENT)
 		who_present();
+	else if (pflags & PF_SETTLE) {
+		int64_t *bal = pflags & PF_NET ? net_balances() : ge_balances();
+		settle(bal, idm_n);
+		free(bal);
+	} else if (pflags & PF_NET)
+		net_show_all();
 	else
 		ge_show_all();
 
+	if (pflags & PF_PHASES) {
+		fflush(stdout);
+		phase_mark(PH_OUT);
+		phase_show();
+	}
+
+	if (pflags & PF_TIMING)
+		stat_show();
+
 	return EXIT_SUCCESS;
 }